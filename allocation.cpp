@@ -0,0 +1,27 @@
+#include "allocation.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<long> allocationCount(0);
+
+long getAllocationCount(){
+  return allocationCount;
+}
+
+void* operator new(size_t size){
+  allocationCount++;
+  void *p = std::malloc(size == 0 ? 1 : size);
+  if(p == nullptr){
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept{
+  std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept{
+  std::free(p);
+}
@@ -0,0 +1,9 @@
+#ifndef ALLOCATION_CPP_H_
+#define ALLOCATION_CPP_H_
+
+// Counts every operator new of the process, including the ones inside ONNX Runtime and OpenCV.
+// The counting operator new lives in allocation.cpp, which is compiled into the executables
+// that want it rather than into sam3_cpp_lib, so applications using the library keep their own.
+long getAllocationCount();
+
+#endif
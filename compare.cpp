@@ -0,0 +1,313 @@
+#include <gflags/gflags.h>
+#include <thread>
+#include <opencv2/opencv.hpp>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdio>
+#include "sam3.h"
+
+DEFINE_string(model_dir, "sam3", "Directory with the exported models");
+DEFINE_string(tokenizer, "sam3/tokenizer.json", "Path to the tokenizer");
+DEFINE_string(baseline, "fp32,fp32,fp32", "Baseline profile: vision,text,decoder precision");
+DEFINE_string(candidate, "int8,int8,int8", "Candidate profile: vision,text,decoder precision");
+DEFINE_string(images, "david-tomaseti-Vw2HZQ1FGjU-unsplash.jpg", "Comma separated image paths or a directory");
+DEFINE_string(text, "zebra", "Text prompt");
+DEFINE_string(boxes, "", "Boxes prompt");
+DEFINE_double(threshold, 0.5, "Threshold for detections");
+DEFINE_string(device, "cpu", "cpu or cuda:0(1,2,3...)");
+DEFINE_double(min_iou, 0.9, "Gate: minimum mean mask IoU of the candidate");
+DEFINE_double(max_score_delta, 0.05, "Gate: maximum mean score delta of the candidate");
+DEFINE_double(max_latency_ratio, 1.0, "Gate: maximum candidate / baseline latency");
+
+struct Detections {
+  std::vector<cv::Mat> masks;
+  std::vector<int> boxes;
+  std::vector<float> scores;
+};
+
+struct RunResult {
+  std::vector<Detections> detections;
+  double encodeSec = 0;
+  double decodeSec = 0;
+  double memoryMB = 0;
+};
+
+// Peak resident memory of this process. Each profile runs in its own child process, so the
+// number does not depend on which profile ran first.
+double getPeakMemoryMB(){
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0){
+    return 0;
+  }
+#if defined(__APPLE__)
+  return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+  return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+template<typename T> bool writeVector(FILE *f, const std::vector<T> &values){
+  size_t size = values.size();
+  return fwrite(&size, sizeof(size), 1, f) == 1 && (size == 0 || fwrite(values.data(), sizeof(T), size, f) == size);
+}
+
+template<typename T> bool readVector(FILE *f, std::vector<T> *values){
+  size_t size = 0;
+  if(fread(&size, sizeof(size), 1, f) != 1){
+    return false;
+  }
+  values->resize(size);
+  return size == 0 || fread(values->data(), sizeof(T), size, f) == size;
+}
+
+// The child process sends its RunResult to the parent through a pipe.
+bool writeRunResult(FILE *f, const RunResult &result){
+  double numbers[3] = {result.encodeSec, result.decodeSec, result.memoryMB};
+  size_t count = result.detections.size();
+  bool ok = fwrite(numbers, sizeof(double), 3, f) == 3 && fwrite(&count, sizeof(count), 1, f) == 1;
+  for(int n = 0; ok && n < count; n++){
+    const Detections &detections = result.detections[n];
+    size_t masks = detections.masks.size();
+    ok = fwrite(&masks, sizeof(masks), 1, f) == 1;
+    for(int i = 0; ok && i < masks; i++){
+      cv::Mat mask = detections.masks[i].isContinuous() ? detections.masks[i] : detections.masks[i].clone();
+      int header[3] = {mask.rows, mask.cols, mask.type()};
+      size_t bytes = mask.total() * mask.elemSize();
+      ok = fwrite(header, sizeof(int), 3, f) == 3 && (bytes == 0 || fwrite(mask.data, 1, bytes, f) == bytes);
+    }
+    ok = ok && writeVector(f, detections.boxes) && writeVector(f, detections.scores);
+  }
+  return ok && fflush(f) == 0;
+}
+
+bool readRunResult(FILE *f, RunResult *result){
+  double numbers[3];
+  size_t count = 0;
+  if(fread(numbers, sizeof(double), 3, f) != 3 || fread(&count, sizeof(count), 1, f) != 1){
+    return false;
+  }
+  result->encodeSec = numbers[0];
+  result->decodeSec = numbers[1];
+  result->memoryMB = numbers[2];
+  result->detections.resize(count);
+  for(int n = 0; n < count; n++){
+    Detections &detections = result->detections[n];
+    size_t masks = 0;
+    if(fread(&masks, sizeof(masks), 1, f) != 1){
+      return false;
+    }
+    detections.masks.resize(masks);
+    for(int i = 0; i < masks; i++){
+      int header[3];
+      if(fread(header, sizeof(int), 3, f) != 3){
+        return false;
+      }
+      detections.masks[i].create(header[0], header[1], header[2]);
+      size_t bytes = detections.masks[i].total() * detections.masks[i].elemSize();
+      if(bytes > 0 && fread(detections.masks[i].data, 1, bytes, f) != bytes){
+        return false;
+      }
+    }
+    if(!readVector(f, &detections.boxes) || !readVector(f, &detections.scores)){
+      return false;
+    }
+  }
+  return true;
+}
+
+bool parseProfile(const std::string &text, Sam3ModelProfile *profile){
+  std::vector<std::string> values = split(text, ',');
+  if(values.size() != 3){
+    return false;
+  }
+  profile->vision = values[0];
+  profile->text = values[1];
+  profile->decoder = values[2];
+  return true;
+}
+
+std::vector<std::string> listImages(const std::string &images){
+  std::vector<std::string> paths = split(images, ',');
+  struct stat st;
+  if(paths.size() != 1 || stat(paths[0].c_str(), &st) != 0 || !S_ISDIR(st.st_mode)){
+    return paths;
+  }
+  std::vector<std::string> files, png;
+  cv::glob(paths[0] + "/*.jpg", files, false);
+  cv::glob(paths[0] + "/*.png", png, false);
+  files.insert(files.end(), png.begin(), png.end());
+  return files;
+}
+
+double seconds(std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end){
+  return (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0;
+}
+
+bool run(const Sam3ModelProfile &profile, const std::vector<std::string> &images, RunResult *result){
+  Sam3 sam3;
+  if(!sam3.loadModel(FLAGS_model_dir, profile, FLAGS_tokenizer, std::thread::hardware_concurrency(), FLAGS_device)){
+    std::cout<<"loadModel error"<<std::endl;
+    return false;
+  }
+  Sam3ModelProfile loaded = sam3.getModelProfile();
+  std::cout<<"loaded "<<loaded.vision<<","<<loaded.text<<","<<loaded.decoder<<std::endl;
+  std::chrono::steady_clock::time_point begin, end;
+  for(int n = 0; n < images.size(); n++){
+    cv::Mat image = cv::imread(images[n], cv::IMREAD_COLOR);
+    if(image.empty()){
+      std::cout<<"Cannot read "<<images[n]<<std::endl;
+      return false;
+    }
+    cv::Size imageSize = cv::Size(image.cols, image.rows);
+    cv::resize(image, image, sam3.getInputSize());
+    std::vector<std::string> text_list = split(FLAGS_text, ',');
+    auto [rects_list, labels_list] = parse_box_list_prompts(FLAGS_boxes, imageSize);
+    sam3.alignTextsAndBoxes(&text_list, &rects_list, &labels_list);
+    begin = std::chrono::steady_clock::now();
+    if(!sam3.preprocessImage(image) || !sam3.encodeText(text_list)){
+      return false;
+    }
+    end = std::chrono::steady_clock::now();
+    result->encodeSec += seconds(begin, end);
+    begin = std::chrono::steady_clock::now();
+    Detections detections;
+    std::tie(detections.masks, detections.boxes) = sam3.decode(rects_list, labels_list, FLAGS_threshold, imageSize, false);
+    end = std::chrono::steady_clock::now();
+    result->decodeSec += seconds(begin, end);
+    detections.scores = sam3.getScores();
+    result->detections.push_back(detections);
+  }
+  result->memoryMB = getPeakMemoryMB();
+  return true;
+}
+
+// Runs one profile in a child process, so its peak memory is its own and nothing it loaded
+// is still around for the next profile.
+bool runInChild(const Sam3ModelProfile &profile, const std::vector<std::string> &images, RunResult *result){
+  int fds[2];
+  if(pipe(fds) != 0){
+    std::cout<<"pipe error"<<std::endl;
+    return false;
+  }
+  std::cout.flush();
+  pid_t pid = fork();
+  if(pid < 0){
+    std::cout<<"fork error"<<std::endl;
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if(pid == 0){
+    close(fds[0]);
+    FILE *out = fdopen(fds[1], "wb");
+    bool success = out != nullptr && run(profile, images, result) && writeRunResult(out, *result);
+    if(out != nullptr){
+      fclose(out);
+    }
+    std::cout.flush();
+    _exit(success ? 0 : 1);
+  }
+  close(fds[1]);
+  FILE *in = fdopen(fds[0], "rb");
+  bool success = in != nullptr && readRunResult(in, result);
+  if(in != nullptr){
+    fclose(in);
+  }else{
+    close(fds[0]);
+  }
+  int status = 0;
+  if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+    return false;
+  }
+  return success;
+}
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineNonHelpFlags(&argc, &argv, true);
+  Sam3ModelProfile baselineProfile, candidateProfile;
+  if(!parseProfile(FLAGS_baseline, &baselineProfile) || !parseProfile(FLAGS_candidate, &candidateProfile)){
+    std::cout<<"Profiles must be vision,text,decoder"<<std::endl;
+    return 1;
+  }
+  std::vector<std::string> images = listImages(FLAGS_images);
+  if(images.size() == 0){
+    std::cout<<"No images"<<std::endl;
+    return 1;
+  }
+  RunResult baseline, candidate;
+  std::cout<<"baseline "<<FLAGS_baseline<<std::endl;
+  if(!runInChild(baselineProfile, images, &baseline)){
+    return 1;
+  }
+  std::cout<<"candidate "<<FLAGS_candidate<<std::endl;
+  if(!runInChild(candidateProfile, images, &candidate)){
+    return 1;
+  }
+
+  // Each baseline detection is matched to the unused candidate mask with the highest IoU.
+  // Missing and extra detections count as IoU 0 and score delta equal to their own score.
+  double iouSum = 0, scoreDeltaSum = 0, boxDeltaSum = 0;
+  int matched = 0, total = 0, extra = 0;
+  for(int n = 0; n < images.size(); n++){
+    const Detections &a = baseline.detections[n];
+    const Detections &b = candidate.detections[n];
+    std::vector<bool> used(b.masks.size(), false);
+    double imageIou = 0;
+    for(int i = 0; i < a.masks.size(); i++){
+      int best = -1;
+      float bestIou = 0;
+      for(int j = 0; j < b.masks.size(); j++){
+        if(used[j]){
+          continue;
+        }
+        float iou = calc_mask_iou(a.masks[i], b.masks[j]);
+        if(iou > bestIou){
+          bestIou = iou;
+          best = j;
+        }
+      }
+      total++;
+      if(best < 0){
+        scoreDeltaSum += a.scores[i];
+        continue;
+      }
+      used[best] = true;
+      matched++;
+      iouSum += bestIou;
+      imageIou += bestIou;
+      scoreDeltaSum += std::abs(a.scores[i] - b.scores[best]);
+      for(int k = 0; k < 4; k++){
+        boxDeltaSum += std::abs(a.boxes[i * 4 + k] - b.boxes[best * 4 + k]) / 4.0;
+      }
+    }
+    for(int j = 0; j < b.masks.size(); j++){
+      if(!used[j]){
+        scoreDeltaSum += b.scores[j];
+        extra++;
+      }
+    }
+    std::cout<<images[n]<<" baseline "<<a.masks.size()<<" candidate "<<b.masks.size();
+    if(a.masks.size() > 0){
+      std::cout<<" iou "<<imageIou / a.masks.size();
+    }
+    std::cout<<std::endl;
+  }
+  total += extra;
+  double meanIou = total > 0 ? iouSum / total : 1;
+  double meanScoreDelta = total > 0 ? scoreDeltaSum / total : 0;
+  double meanBoxDelta = matched > 0 ? boxDeltaSum / matched : 0;
+  double baselineSec = (baseline.encodeSec + baseline.decodeSec) / images.size();
+  double candidateSec = (candidate.encodeSec + candidate.decodeSec) / images.size();
+  double latencyRatio = baselineSec > 0 ? candidateSec / baselineSec : 1;
+
+  std::cout<<"images "<<images.size()<<" detections "<<total<<" matched "<<matched<<std::endl;
+  std::cout<<"baseline  encode sec = "<<baseline.encodeSec / images.size()<<" decode sec = "<<baseline.decodeSec / images.size()<<" peak memory MB = "<<baseline.memoryMB<<std::endl;
+  std::cout<<"candidate encode sec = "<<candidate.encodeSec / images.size()<<" decode sec = "<<candidate.decodeSec / images.size()<<" peak memory MB = "<<candidate.memoryMB<<std::endl;
+  std::cout<<"mask iou = "<<meanIou<<" score delta = "<<meanScoreDelta<<" box delta px = "<<meanBoxDelta<<" latency ratio = "<<latencyRatio<<std::endl;
+
+  bool pass = meanIou >= FLAGS_min_iou && meanScoreDelta <= FLAGS_max_score_delta && latencyRatio <= FLAGS_max_latency_ratio;
+  std::cout<<(pass ? "PASS" : "FAIL")<<std::endl;
+  return pass ? 0 : 1;
+}
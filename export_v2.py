@@ -2,6 +2,7 @@ import argparse
 import math
 from pathlib import Path
 
+import onnx
 import torch
 import torch.nn as nn
 import torchvision
@@ -287,15 +288,7 @@ class DecoderCoreWrapper(nn.Module):
         self.dot_product_scoring = sam3_model.dot_product_scoring
         self.box_head = sam3_model.detr_decoder.box_head
 
-    def forward(
-        self,
-        fpn_feat_0,
-        fpn_feat_1,
-        fpn_feat_2,
-        fpn_pos_2,
-        prompt_features,
-        prompt_mask,
-    ):
+    def score(self, fpn_feat_2, fpn_pos_2, prompt_features, prompt_mask):
         encoder_outputs = self.detr_encoder(
             vision_features=[fpn_feat_2],
             text_features=prompt_features,
@@ -328,10 +321,35 @@ class DecoderCoreWrapper(nn.Module):
         decoder_hidden_states = decoder_outputs.intermediate_hidden_states[-1]
         presence_logits = decoder_outputs.presence_logits[-1]
 
+        return (
+            pred_boxes,
+            pred_logits,
+            presence_logits,
+            decoder_hidden_states,
+            encoder_outputs.last_hidden_state,
+        )
+
+    def forward(
+        self,
+        fpn_feat_0,
+        fpn_feat_1,
+        fpn_feat_2,
+        fpn_pos_2,
+        prompt_features,
+        prompt_mask,
+    ):
+        (
+            pred_boxes,
+            pred_logits,
+            presence_logits,
+            decoder_hidden_states,
+            encoder_hidden_states,
+        ) = self.score(fpn_feat_2, fpn_pos_2, prompt_features, prompt_mask)
+
         mask_outputs = self.mask_decoder(
             decoder_queries=decoder_hidden_states,
             backbone_features=[fpn_feat_0, fpn_feat_1, fpn_feat_2],
-            encoder_hidden_states=encoder_outputs.last_hidden_state,
+            encoder_hidden_states=encoder_hidden_states,
             prompt_features=prompt_features,
             prompt_mask=prompt_mask,
         )
@@ -388,13 +406,148 @@ class DecoderWithGeometryWrapper(nn.Module):
         )
 
 
+class DecoderScoreStageWrapper(nn.Module):
+    """First stage of the split decoder: everything except the mask head.
+
+    The hidden states needed by the mask head are returned so that
+    DecoderMaskStageWrapper can run later for the kept queries only.
+    """
+
+    def __init__(self, sam3_model: Sam3Model):
+        super().__init__()
+        self.geometry = GeometryEncoderWrapper(sam3_model)
+        self.decoder = DecoderCoreWrapper(sam3_model)
+
+    def forward(
+        self,
+        fpn_feat_2,
+        fpn_pos_2,
+        text_features,
+        text_mask,
+        input_boxes,
+        input_boxes_labels,
+    ):
+        geometry_features, geometry_mask = self.geometry(
+            input_boxes=input_boxes,
+            input_boxes_labels=input_boxes_labels,
+            fpn_feat=fpn_feat_2,
+            fpn_pos=fpn_pos_2,
+        )
+
+        prompt_features = torch.cat([text_features, geometry_features], dim=1)
+        prompt_mask = torch.cat([text_mask, geometry_mask], dim=1)
+
+        (
+            pred_boxes,
+            pred_logits,
+            presence_logits,
+            decoder_hidden_states,
+            encoder_hidden_states,
+        ) = self.decoder.score(fpn_feat_2, fpn_pos_2, prompt_features, prompt_mask)
+
+        return (
+            pred_boxes,
+            pred_logits,
+            presence_logits,
+            decoder_hidden_states,
+            encoder_hidden_states,
+            prompt_features,
+            prompt_mask,
+        )
+
+
+class DecoderMaskStageWrapper(nn.Module):
+    """Second stage of the split decoder: masks for the selected queries of one image."""
+
+    def __init__(self, sam3_model: Sam3Model):
+        super().__init__()
+        self.mask_decoder = sam3_model.mask_decoder
+
+    def forward(
+        self,
+        fpn_feat_0,
+        fpn_feat_1,
+        fpn_feat_2,
+        decoder_hidden_states,
+        encoder_hidden_states,
+        prompt_features,
+        prompt_mask,
+        query_indices,
+    ):
+        decoder_queries = decoder_hidden_states.index_select(1, query_indices)
+        mask_outputs = self.mask_decoder(
+            decoder_queries=decoder_queries,
+            backbone_features=[fpn_feat_0, fpn_feat_1, fpn_feat_2],
+            encoder_hidden_states=encoder_hidden_states,
+            prompt_features=prompt_features,
+            prompt_mask=prompt_mask,
+        )
+        return mask_outputs.pred_masks
+
+
+def set_precision_metadata(path: Path, precision: str):
+    # External weights stay where they are, only the graph proto is rewritten.
+    model = onnx.load(str(path), load_external_data=False)
+    for prop in model.metadata_props:
+        if prop.key == "precision":
+            prop.value = precision
+            break
+    else:
+        model.metadata_props.add(key="precision", value=precision)
+    onnx.save(model, str(path))
+
+
+def export_precisions(output_dir: Path, name: str, precisions, quantize: bool = False):
+    """Write name.<precision>.onnx variants next to the fp32 name.onnx.
+
+    --quantize keeps its original behaviour and replaces name.onnx with int8.
+    """
+    fp32_path = output_dir / f"{name}.onnx"
+    set_precision_metadata(fp32_path, "fp32")
+    for precision in precisions:
+        if precision == "fp32":
+            continue
+        path = output_dir / f"{name}.{precision}.onnx"
+        if precision == "int8":
+            quantize_dynamic(
+                model_input=str(fp32_path),
+                model_output=str(path),
+                per_channel=False,
+                reduce_range=False,
+                weight_type=QuantType.QUInt8,
+            )
+        elif precision == "fp16":
+            try:
+                from onnxconverter_common import float16
+            except ImportError:
+                raise SystemExit(
+                    "fp16 export needs onnxconverter-common: pip install onnxconverter-common"
+                )
+
+            model = float16.convert_float_to_float16(
+                onnx.load(str(fp32_path)), keep_io_types=True
+            )
+            onnx.save(model, str(path))
+        set_precision_metadata(path, precision)
+    if quantize:
+        quantize_dynamic(
+            model_input=str(fp32_path),
+            model_output=str(fp32_path),
+            per_channel=False,
+            reduce_range=False,
+            weight_type=QuantType.QUInt8,
+        )
+        set_precision_metadata(fp32_path, "int8")
+
+
 def export_vision_encoder(
     model: Sam3Model,
     output_dir: Path,
     device: str = "cuda",
     image_height: int = 504,
     image_width: int = 896,
-    quantize: bool = False
+    quantize: bool = False,
+    precisions: tuple = ("fp32",),
 ):
     wrapper = (
         VisionEncoderWrapperV2(
@@ -421,17 +574,16 @@ def export_vision_encoder(
             "fpn_pos_2": {0: "batch"},
         },
     )
-    if quantize:
-        quantize_dynamic(
-            model_input=str(output_dir / "vision-encoder.onnx"),
-            model_output=str(output_dir / "vision-encoder.onnx"),
-            per_channel=False,
-            reduce_range=False,
-            weight_type=QuantType.QUInt8,
-        )
+    export_precisions(output_dir, "vision-encoder", precisions, quantize)
 
 
-def export_text_encoder(model: Sam3Model, output_dir: Path, device: str = "cuda", quantize: bool = False):
+def export_text_encoder(
+    model: Sam3Model,
+    output_dir: Path,
+    device: str = "cuda",
+    quantize: bool = False,
+    precisions: tuple = ("fp32",),
+):
     wrapper = TextEncoderWrapper(model).to(device).eval()
 
     torch.onnx.export(
@@ -453,14 +605,7 @@ def export_text_encoder(model: Sam3Model, output_dir: Path, device: str = "cuda"
             "text_mask": {0: "batch"},
         },
     )
-    if quantize:
-        quantize_dynamic(
-            model_input=str(output_dir / "text-encoder.onnx"),
-            model_output=str(output_dir / "text-encoder.onnx"),
-            per_channel=False,
-            reduce_range=False,
-            weight_type=QuantType.QUInt8,
-        )
+    export_precisions(output_dir, "text-encoder", precisions, quantize)
 
 
 def export_decoder(
@@ -469,7 +614,8 @@ def export_decoder(
     device: str = "cuda",
     image_height: int = 504,
     image_width: int = 896,
-    quantize: bool = False
+    quantize: bool = False,
+    precisions: tuple = ("fp32",),
 ):
     wrapper = DecoderWithGeometryWrapper(model).to(device).eval()
 
@@ -521,14 +667,110 @@ def export_decoder(
             "presence_logits": {0: "batch"},
         },
     )
-    if quantize:
-        quantize_dynamic(
-            model_input=str(output_dir / "decoder.onnx"),
-            model_output=str(output_dir / "decoder.onnx"),
-            per_channel=False,
-            reduce_range=False,
-            weight_type=QuantType.QUInt8,
-        )
+    export_precisions(output_dir, "decoder", precisions, quantize)
+
+
+def export_split_decoder(
+    model: Sam3Model,
+    output_dir: Path,
+    device: str = "cuda",
+    image_height: int = 504,
+    image_width: int = 896,
+    quantize: bool = False,
+    precisions: tuple = ("fp32",),
+):
+    patch_h = image_height // 14
+    patch_w = image_width // 14
+    fpn2_h, fpn2_w = patch_h, patch_w
+    fpn1_h, fpn1_w = patch_h * 2, patch_w * 2
+    fpn0_h, fpn0_w = patch_h * 4, patch_w * 4
+
+    score_wrapper = DecoderScoreStageWrapper(model).to(device).eval()
+    score_inputs = (
+        torch.randn(1, 256, fpn2_h, fpn2_w, device=device),
+        torch.randn(1, 256, fpn2_h, fpn2_w, device=device),
+        torch.randn(1, 32, 256, device=device),
+        torch.ones(1, 32, dtype=torch.bool, device=device),
+        torch.rand(1, 5, 4, device=device),
+        torch.ones(1, 5, dtype=torch.long, device=device),
+    )
+    torch.onnx.export(
+        score_wrapper,
+        score_inputs,
+        str(output_dir / "decoder-score.onnx"),
+        input_names=[
+            "fpn_feat_2",
+            "fpn_pos_2",
+            "text_features",
+            "text_mask",
+            "input_boxes",
+            "input_boxes_labels",
+        ],
+        output_names=[
+            "pred_boxes",
+            "pred_logits",
+            "presence_logits",
+            "decoder_hidden_states",
+            "encoder_hidden_states",
+            "prompt_features",
+            "prompt_mask",
+        ],
+        opset_version=17,
+        do_constant_folding=True,
+        dynamo=False,
+        dynamic_axes={
+            "fpn_feat_2": {0: "batch"},
+            "fpn_pos_2": {0: "batch"},
+            "text_features": {0: "batch"},
+            "text_mask": {0: "batch"},
+            "input_boxes": {0: "batch", 1: "num_boxes"},
+            "input_boxes_labels": {0: "batch", 1: "num_boxes"},
+            "pred_boxes": {0: "batch"},
+            "pred_logits": {0: "batch"},
+            "presence_logits": {0: "batch"},
+            "decoder_hidden_states": {0: "batch"},
+            "encoder_hidden_states": {0: "batch"},
+            "prompt_features": {0: "batch", 1: "prompt_length"},
+            "prompt_mask": {0: "batch", 1: "prompt_length"},
+        },
+    )
+    export_precisions(output_dir, "decoder-score", precisions, quantize)
+
+    # Example hidden states come from a real score stage run.
+    score_outputs = score_wrapper(*score_inputs)
+    mask_wrapper = DecoderMaskStageWrapper(model).to(device).eval()
+    torch.onnx.export(
+        mask_wrapper,
+        (
+            torch.randn(1, 256, fpn0_h, fpn0_w, device=device),
+            torch.randn(1, 256, fpn1_h, fpn1_w, device=device),
+            score_inputs[0],
+            *score_outputs[3:],
+            torch.arange(3, dtype=torch.long, device=device),
+        ),
+        str(output_dir / "decoder-mask.onnx"),
+        input_names=[
+            "fpn_feat_0",
+            "fpn_feat_1",
+            "fpn_feat_2",
+            "decoder_hidden_states",
+            "encoder_hidden_states",
+            "prompt_features",
+            "prompt_mask",
+            "query_indices",
+        ],
+        output_names=["pred_masks"],
+        opset_version=17,
+        do_constant_folding=True,
+        dynamo=False,
+        dynamic_axes={
+            "prompt_features": {1: "prompt_length"},
+            "prompt_mask": {1: "prompt_length"},
+            "query_indices": {0: "num_selected"},
+            "pred_masks": {1: "num_selected"},
+        },
+    )
+    export_precisions(output_dir, "decoder-mask", precisions, quantize)
 
 
 def main():
@@ -547,6 +789,19 @@ def main():
     parser.add_argument("--image-height", type=int, default=504)
     parser.add_argument("--image-width", type=int, default=896)
     parser.add_argument("--quantize", action="store_true", help="Quantize models")
+    parser.add_argument(
+        "--split-decoder",
+        action="store_true",
+        help="Export decoder-score.onnx and decoder-mask.onnx instead of decoder.onnx",
+    )
+    parser.add_argument(
+        "--precision",
+        type=str,
+        nargs="+",
+        choices=["fp32", "fp16", "int8"],
+        default=["fp32"],
+        help="Also write name.<precision>.onnx variants for Sam3ModelProfile",
+    )
     args = parser.parse_args()
 
     if not args.module and not args.all:
@@ -571,18 +826,23 @@ def main():
                     args.device,
                     image_height=args.image_height,
                     image_width=args.image_width,
-                    quantize=args.quantize
+                    quantize=args.quantize,
+                    precisions=args.precision,
                 )
             elif m == "text":
-                export_text_encoder(model, output_dir, args.device, args.quantize)
+                export_text_encoder(
+                    model, output_dir, args.device, args.quantize, args.precision
+                )
             elif m == "decoder":
-                export_decoder(
+                export = export_split_decoder if args.split_decoder else export_decoder
+                export(
                     model,
                     output_dir,
                     args.device,
                     image_height=args.image_height,
                     image_width=args.image_width,
-                    quantize=args.quantize
+                    quantize=args.quantize,
+                    precisions=args.precision,
                 )
 
 
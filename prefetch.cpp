@@ -0,0 +1,212 @@
+#include "prefetch.h"
+#include <opencv2/opencv.hpp>
+#if defined(__APPLE__)
+#include <pthread.h>
+#else
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// The worker only feeds the shared ORT thread pool, so this mostly keeps image decoding
+// out of the way. Preemption is what keeps foreground latency flat.
+static void lowerThreadPriority(){
+#if defined(__APPLE__)
+  pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#else
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+#endif
+}
+
+Sam3Prefetcher::Sam3Prefetcher(Sam3 *sam3) : sam3(sam3){
+  sam3->setForegroundHook([this](bool active){
+    if(active){
+      pause();
+    }else{
+      resume();
+    }
+  });
+  worker = std::thread(&Sam3Prefetcher::run, this);
+}
+
+Sam3Prefetcher::~Sam3Prefetcher(){
+  sam3->setForegroundHook(nullptr);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    cancelRunning(false);
+    condition.notify_all();
+  }
+  worker.join();
+}
+
+// The image is read and resized before the job is published as running, so a foreground call
+// only ever waits for an encoder Run to notice its terminate flag, never for a JPEG decode.
+void Sam3Prefetcher::run(){
+  lowerThreadPriority();
+  std::unique_lock<std::mutex> lock(mutex);
+  while(true){
+    condition.wait(lock, [&](){
+      return stopping || (pauseCount == 0 && queue.size() > 0);
+    });
+    if(stopping){
+      break;
+    }
+    // Back to back foreground calls resume in between, only start once they have settled
+    std::chrono::steady_clock::time_point idleUntil = lastForeground + idleDelay;
+    if(std::chrono::steady_clock::now() < idleUntil){
+      condition.wait_until(lock, idleUntil);
+      continue;
+    }
+    std::string path = queue.front();
+    queue.pop_front();
+    // No foreground call is running while pauseCount is 0, so the input size is stable here
+    cv::Size inputSize = sam3->getInputSize();
+    loading = path;
+    loadingCancelled = false;
+    lock.unlock();
+
+    Result result;
+    cv::Mat image = cv::imread(path, cv::IMREAD_COLOR);
+    if(!image.empty() && inputSize.area() == 0){
+      image.release();
+    }
+    if(!image.empty()){
+      result.imageSize = cv::Size(image.cols, image.rows);
+      cv::resize(image, image, inputSize);
+    }
+
+    lock.lock();
+    // Stays the loading path while paused, so take keeps waiting for it
+    condition.wait(lock, [&](){
+      return stopping || loadingCancelled || pauseCount == 0;
+    });
+    loading.clear();
+    if(stopping){
+      break;
+    }
+    if(image.empty() || loadingCancelled){
+      condition.notify_all();
+      continue;
+    }
+    if(sam3->getInputSize() != inputSize){
+      // Another resolution was selected while the image was loading
+      queue.push_front(path);
+      condition.notify_all();
+      continue;
+    }
+    std::shared_ptr<Job> job = std::make_shared<Job>();
+    job->path = path;
+    running = job;
+    lock.unlock();
+
+    bool success = false;
+    if(!job->cancelled){
+      success = sam3->encodeImage(image, &result.context, &job->runOptions);
+    }
+
+    lock.lock();
+    running = nullptr;
+    if(job->cancelled){
+      if(job->requeue && std::find(queue.begin(), queue.end(), job->path) == queue.end()){
+        queue.push_front(job->path);
+      }
+    }else if(success){
+      results[job->path] = std::move(result);
+    }
+    condition.notify_all();
+  }
+}
+
+// Called with the mutex held.
+void Sam3Prefetcher::cancelRunning(bool requeue){
+  if(running && !running->cancelled){
+    running->cancelled = true;
+    running->requeue = requeue;
+    running->runOptions.SetTerminate();
+  }
+}
+
+// paths is the order the user moves through, current the image on screen. The next depth
+// images are queued nearest first; anything else queued, running or encoded is dropped.
+void Sam3Prefetcher::setImages(const std::vector<std::string> &paths, int current, int depth){
+  std::lock_guard<std::mutex> lock(mutex);
+  std::vector<std::string> window;
+  for(int i = current; i <= current + depth && i < (int)paths.size(); i++){
+    if(i >= 0){
+      window.push_back(paths[i]);
+    }
+  }
+  auto inWindow = [&](const std::string &path){
+    return std::find(window.begin(), window.end(), path) != window.end();
+  };
+  for(auto it = results.begin(); it != results.end();){
+    if(inWindow(it->first)){
+      it++;
+    }else{
+      it = results.erase(it);
+    }
+  }
+  if(running && !inWindow(running->path)){
+    cancelRunning(false);
+    running->requeue = false;
+  }
+  if(loading.size() > 0 && !inWindow(loading)){
+    loadingCancelled = true;
+  }
+  // The current image is left to the foreground unless it is already encoding or encoded
+  queue.clear();
+  for(int i = 1; i < window.size(); i++){
+    bool busy = (running && !running->cancelled && running->path == window[i]) || (loading == window[i] && !loadingCancelled);
+    if(results.count(window[i]) == 0 && !busy){
+      queue.push_back(window[i]);
+    }
+  }
+  condition.notify_all();
+}
+
+// Moves the embeddings of path into context. A job still loading or encoding path is waited
+// for, since it is further along than a new foreground encode would be.
+bool Sam3Prefetcher::take(const std::string &path, Sam3Context *context, cv::Size *imageSize){
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [&](){
+    return !(running && !running->cancelled && running->path == path) && !(loading == path && !loadingCancelled);
+  });
+  auto it = results.find(path);
+  if(it == results.end()){
+    return false;
+  }
+  bool valid = it->second.context.visionResolution == sam3->getResolutionIndex();
+  if(valid){
+    *context = std::move(it->second.context);
+    *imageSize = it->second.imageSize;
+  }
+  results.erase(it);
+  return valid;
+}
+
+// Blocks until the running job has stopped, so the foreground has the sessions to itself.
+void Sam3Prefetcher::pause(){
+  std::unique_lock<std::mutex> lock(mutex);
+  pauseCount++;
+  cancelRunning(true);
+  condition.wait(lock, [&](){
+    return running == nullptr;
+  });
+}
+
+void Sam3Prefetcher::resume(){
+  std::lock_guard<std::mutex> lock(mutex);
+  if(pauseCount > 0){
+    pauseCount--;
+  }
+  lastForeground = std::chrono::steady_clock::now();
+  condition.notify_all();
+}
+
+// How long the foreground has to be idle before the next job starts.
+void Sam3Prefetcher::setIdleDelay(int milliseconds){
+  std::lock_guard<std::mutex> lock(mutex);
+  idleDelay = std::chrono::milliseconds(std::max(0, milliseconds));
+  condition.notify_all();
+}
@@ -0,0 +1,57 @@
+#ifndef SAM3_PREFETCH_H_
+#define SAM3_PREFETCH_H_
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include "sam3.h"
+
+// Encodes the next images of the caller's list in the background, so landing on an image
+// does not wait for the vision encoder. Every job has its own RunOptions. Foreground calls
+// on Sam3 pause the prefetcher through the foreground hook, which terminates the running
+// job and puts it back at the front of the queue. A new job starts only after the
+// foreground has been idle for the idle delay.
+// Destroy the prefetcher before the Sam3 it was created with.
+class Sam3Prefetcher {
+  struct Job {
+    std::string path;
+    Ort::RunOptions runOptions;
+    // Read by the worker outside the mutex
+    std::atomic<bool> cancelled{false};
+    bool requeue = false;
+  };
+  struct Result {
+    Sam3Context context;
+    cv::Size imageSize;
+  };
+  Sam3 *sam3;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<std::string> queue;
+  std::map<std::string, Result> results;
+  std::shared_ptr<Job> running;
+  // Path read from disk before it becomes the running job
+  std::string loading;
+  bool loadingCancelled = false;
+  std::chrono::steady_clock::time_point lastForeground;
+  std::chrono::milliseconds idleDelay{100};
+  int pauseCount = 0;
+  bool stopping = false;
+  void run();
+  void cancelRunning(bool requeue);
+ public:
+  Sam3Prefetcher(Sam3 *sam3);
+  ~Sam3Prefetcher();
+  void setImages(const std::vector<std::string> &paths, int current, int depth);
+  bool take(const std::string &path, Sam3Context *context, cv::Size *imageSize);
+  void pause();
+  void resume();
+  void setIdleDelay(int milliseconds);
+};
+
+#endif
@@ -1,6 +1,30 @@
 #include "sam3.h"
 #include <opencv2/opencv.hpp>
 #include <future>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+
+static void cacheIONames(Ort::Session* sess,
+                         std::vector<std::string>& inNames,  std::vector<const char*>& inPtrs,
+                         std::vector<std::string>& outNames, std::vector<const char*>& outPtrs){
+  Ort::AllocatorWithDefaultOptions alloc;
+
+  inNames.clear();
+  for(size_t i = 0; i < sess->GetInputCount(); i++)
+    inNames.push_back(sess->GetInputNameAllocated(i, alloc).get());
+
+  outNames.clear();
+  for(size_t i = 0; i < sess->GetOutputCount(); i++)
+    outNames.push_back(sess->GetOutputNameAllocated(i, alloc).get());
+
+  // Only build pointer vectors AFTER all strings are final — no more reallocation
+  inPtrs.clear();
+  for(auto& s : inNames)  inPtrs.push_back(s.c_str());
+
+  outPtrs.clear();
+  for(auto& s : outNames) outPtrs.push_back(s.c_str());
+}
 
 Sam3::Sam3(){}
 Sam3::~Sam3(){
@@ -13,15 +37,22 @@ Sam3::~Sam3(){
   clearLoadModel();
 }
 
+// Paused like any foreground call, a prefetch job must not see the sessions being deleted.
 bool Sam3::clearLoadModel(){
+  foreground(true);
   try{
-    Ort::Session* v = visionEncoder.release();
-    Ort::Session* t = textEncoder.release();
-    Ort::Session* d = decoder.release();
-    delete v;
-    delete t;
-    delete d;
-    inputTensorValuesFloat.resize(0);
+    releaseSession(&visionEncoder);
+    releaseSession(&textEncoder);
+    releaseSession(&decoder);
+    releaseSession(&maskDecoder);
+    for(int i = 0; i < resolutions.size(); i++){
+      releaseSession(&resolutions[i].visionEncoder);
+      releaseSession(&resolutions[i].decoder);
+      releaseSession(&resolutions[i].maskDecoder);
+    }
+    scratch = Sam3Scratch();
+    tokenCache.clear();
+    textCache.clear();
     inputShapeVision.resize(0);
     for(int i = 0; i < 4; i++){
       outputShapeVision[i].resize(0);
@@ -35,9 +66,16 @@ bool Sam3::clearLoadModel(){
     outputText0.resize(0);
     outputText1.resize(0);
     clearDecoder();
+    loadedProfile = Sam3ModelProfile();
+    resolutions.clear();
+    resolutionStats.clear();
+    resolutionIndex = -1;
+    visionResolution = -1;
   }catch(Ort::Exception& e){
+    foreground(false);
     return false;
   }
+  foreground(false);
   return true;
 }
 
@@ -53,10 +91,19 @@ void Sam3::clearDecoder(){
     outputShapeDecoder[i].resize(0);
     outputDecoder[i].resize(0);
   }
+  for(int i = 0; i < 3; i++){
+    outputShapeDecoderStates[i].resize(0);
+    outputDecoderStates[i].resize(0);
+  }
+  outputShapeDecoderPromptMask.resize(0);
+  outputDecoderPromptMask.resize(0);
+  maskSlots.resize(0);
+  outputScores.resize(0);
+  outputBatchIndices.resize(0);
 }
 
 bool Sam3::isDecoderEmpty(){
-  if(outputDecoder[0].size() == 0){
+  if(outputDecoder[2].size() == 0){
     return true;
   }
   return false;
@@ -86,34 +133,21 @@ bool Sam3::loadModel(const std::string& visionPath, const std::string& textPath,
 
     // Replace the Env — must be done before session creation
     env = Ort::Env(threadingOptions, ORT_LOGGING_LEVEL_WARNING, "test");
+    sessionDevice = device;
+    sessionThreads = threadsNumber;
+    modelPathVision = visionPath;
+    modelPathText = textPath;
+    modelPathDecoder = decoderPath;
 
-    sessionOptions.SetIntraOpNumThreads(threadsNumber);
-    sessionOptions.SetInterOpNumThreads(threadsNumber);  // <-- this was missing
-    sessionOptions.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
-
-    // Disable per-session thread spinning — let global pool handle it
-    sessionOptions.AddConfigEntry("session.intra_op.allow_spinning", "0");
-
-    // Enable memory pattern optimization
-    sessionOptions.EnableMemPattern();
-    sessionOptions.EnableCpuMemArena();
-
-    if(device.substr(0, 5) == "cuda:"){
-      int gpuDeviceId = std::stoi(device.substr(5));
-      OrtCUDAProviderOptions options;
-      options.device_id = gpuDeviceId;
-      sessionOptions.AppendExecutionProvider_CUDA(options);
-    }
-
-    // Replace the three make_unique lines in loadModel() with:
+    // Each model gets the settings of its .tuning file, see tuneSessions
     auto futureVision = std::async(std::launch::async, [&](){
-      return std::make_unique<Ort::Session>(env, visionPath.c_str(), sessionOptions);
+      return createSession(visionPath, getSessionConfig(visionPath));
     });
     auto futureText = std::async(std::launch::async, [&](){
-      return std::make_unique<Ort::Session>(env, textPath.c_str(), sessionOptions);
+      return createSession(textPath, getSessionConfig(textPath));
     });
     auto futureDecoder = std::async(std::launch::async, [&](){
-      return std::make_unique<Ort::Session>(env, decoderPath.c_str(), sessionOptions);
+      return createSession(decoderPath, getSessionConfig(decoderPath));
     });
     auto futureTokenizer = std::async(std::launch::async, [&](){
       auto blob = LoadBytesFromFile(tokenizerPath.c_str());
@@ -124,43 +158,17 @@ bool Sam3::loadModel(const std::string& visionPath, const std::string& textPath,
     decoder       = futureDecoder.get();
     tokenizer     = futureTokenizer.get();
 
-    auto cacheIONames = [](Ort::Session* sess,
-                           std::vector<std::string>& inNames,  std::vector<const char*>& inPtrs,
-                           std::vector<std::string>& outNames, std::vector<const char*>& outPtrs){
-      Ort::AllocatorWithDefaultOptions alloc;
-
-      inNames.clear();
-      for(size_t i = 0; i < sess->GetInputCount(); i++)
-        inNames.push_back(sess->GetInputNameAllocated(i, alloc).get());
-
-      outNames.clear();
-      for(size_t i = 0; i < sess->GetOutputCount(); i++)
-        outNames.push_back(sess->GetOutputNameAllocated(i, alloc).get());
-
-      // Only build pointer vectors AFTER all strings are final — no more reallocation
-      inPtrs.clear();
-      for(auto& s : inNames)  inPtrs.push_back(s.c_str());
-
-      outPtrs.clear();
-      for(auto& s : outNames) outPtrs.push_back(s.c_str());
-    };
-    cacheIONames(visionEncoder.get(), cachedInputNamesVision, ptrInputNamesVision,
-                                      cachedOutputNamesVision, ptrOutputNamesVision);
     cacheIONames(textEncoder.get(),   cachedInputNamesText,   ptrInputNamesText,
                                       cachedOutputNamesText,   ptrOutputNamesText);
-    cacheIONames(decoder.get(),       cachedInputNamesDecoder, ptrInputNamesDecoder,
-                                      cachedOutputNamesDecoder, ptrOutputNamesDecoder);
-    
-    inputShapeVision = visionEncoder->GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
-    inputShapeVision[0] = 1;
-    outputShapeVision[3] = visionEncoder->GetOutputTypeInfo(3).GetTensorTypeAndShapeInfo().GetShape();
-    outputShapeVision[3][0] = 1;
-    outputShapeVision[2] = outputShapeVision[3];
-    outputShapeVision[1] = outputShapeVision[3];
-    outputShapeVision[1][2] = outputShapeVision[1][3] = outputShapeVision[1][2] * 2;
-    outputShapeVision[0] = outputShapeVision[3];
-    outputShapeVision[0][2] = outputShapeVision[0][3] = outputShapeVision[0][2] * 4;
-    
+    if(!initResolution(decoderPath)){
+      loadingEnd();
+      return false;
+    }
+
+    loadedProfile.vision  = getModelPrecision(visionEncoder.get());
+    loadedProfile.text    = getModelPrecision(textEncoder.get());
+    loadedProfile.decoder = getModelPrecision(decoder.get());
+
     inputShapeText[0] = textEncoder->GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
     inputShapeText[1] = textEncoder->GetInputTypeInfo(1).GetTensorTypeAndShapeInfo().GetShape();
     outputShapeText[0] = textEncoder->GetOutputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
@@ -170,14 +178,23 @@ bool Sam3::loadModel(const std::string& visionPath, const std::string& textPath,
     outputShapeText[0][0] = 1;
     outputShapeText[1][0] = 1;
 
-    inputTensorValuesFloat.assign(getShapeSize(inputShapeVision), 0.0f);
+    scratch.inputTensorValuesFloat.assign(getShapeSize(inputShapeVision), 0.0f);
     for(int i = 0; i < 4; i++){
       outputVision[i].assign(getShapeSize(outputShapeVision[i]), 0.0f);
     }
+    resolutions.resize(1);
+    resolutionStats.resize(1);
+    resolutionStats[0].inputSize = getInputSize();
+    resolutionIndex = 0;
   }catch(Ort::Exception& e){
     std::cout << e.what() << std::endl;
     loadingEnd();
     return false;
+  }catch(std::exception& e){
+    // E.g. the tokenizer or a cuda device number that does not parse
+    std::cout << e.what() << std::endl;
+    loadingEnd();
+    return false;
   }
   if(terminating){
     loadingEnd();
@@ -187,22 +204,773 @@ bool Sam3::loadModel(const std::string& visionPath, const std::string& textPath,
   return true;
 }
 
+bool Sam3::loadModel(const std::string& modelDir, const Sam3ModelProfile& profile, const std::string& tokenizerPath, int threadsNumber, const std::string device){
+  if(!isValidPrecision(profile.vision) || !isValidPrecision(profile.text) || !isValidPrecision(profile.decoder)){
+    return false;
+  }
+  std::string visionPath = getModelPath(modelDir, "vision-encoder", profile.vision);
+  std::string textPath = getModelPath(modelDir, "text-encoder", profile.text);
+  std::string decoderPath = getModelPath(modelDir, "decoder", profile.decoder);
+  if(!modelExists(decoderPath)){
+    decoderPath = getModelPath(modelDir, "decoder-score", profile.decoder);
+  }
+  return loadModel(visionPath, textPath, decoderPath, tokenizerPath, threadsNumber, device);
+}
+
+void Sam3::initSessionOptions(Ort::SessionOptions *options, const Sam3SessionConfig &config){
+  options->SetIntraOpNumThreads(sessionThreads);
+  options->SetInterOpNumThreads(sessionThreads);  // <-- this was missing
+  if(config.optimization == "basic"){
+    options->SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_BASIC);
+  }else if(config.optimization == "extended"){
+    options->SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_EXTENDED);
+  }else{
+    options->SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+  }
+
+  // Spinning is off by default — let global pool handle it
+  options->AddConfigEntry("session.intra_op.allow_spinning", config.spinning ? "1" : "0");
+
+  // Enable memory pattern optimization
+  options->EnableMemPattern();
+  if(config.memArena){
+    options->EnableCpuMemArena();
+  }else{
+    options->DisableCpuMemArena();
+  }
+
+  if(sessionDevice.substr(0, 5) == "cuda:"){
+    int gpuDeviceId = std::stoi(sessionDevice.substr(5));
+    OrtCUDAProviderOptions cudaOptions;
+    cudaOptions.device_id = gpuDeviceId;
+    options->AppendExecutionProvider_CUDA(cudaOptions);
+  }else if(config.provider == "xnnpack"){
+    options->AppendExecutionProvider("XNNPACK", {{"intra_op_num_threads", std::to_string(sessionThreads)}});
+  }else if(config.provider == "dnnl"){
+    OrtDnnlProviderOptions *dnnlOptions = nullptr;
+    Ort::ThrowOnError(Ort::GetApi().CreateDnnlProviderOptions(&dnnlOptions));
+    OrtStatus *status = Ort::GetApi().SessionOptionsAppendExecutionProvider_Dnnl(*options, dnnlOptions);
+    Ort::GetApi().ReleaseDnnlProviderOptions(dnnlOptions);
+    Ort::ThrowOnError(status);
+  }
+}
+
+// The .tuning file holds key=value lines, missing keys keep the defaults.
+// Tuned settings are ignored on cuda, when the provider is not in this build, when the file
+// is malformed and when it was tuned with another thread count.
+Sam3SessionConfig Sam3::getSessionConfig(const std::string& modelPath){
+  Sam3SessionConfig config;
+  std::ifstream f(getTuningPath(modelPath));
+  if(!f || sessionDevice != "cpu"){
+    return config;
+  }
+  // Numbers are parsed without exceptions, a broken file must not fail loadModel
+  auto parseNumber = [](const std::string &text, double *value){
+    char *end = nullptr;
+    *value = std::strtod(text.c_str(), &end);
+    return text.size() > 0 && end == text.c_str() + text.size() && std::isfinite(*value);
+  };
+  bool valid = true;
+  std::string line;
+  while(std::getline(f, line) && valid){
+    std::vector<std::string> values = split(line, '=');
+    if(values.size() != 2){
+      continue;
+    }
+    double number = 0;
+    if(values[0] == "provider"){
+      config.provider = values[1];
+      valid = config.provider == "cpu" || config.provider == "xnnpack" || config.provider == "dnnl";
+    }else if(values[0] == "optimization"){
+      config.optimization = values[1];
+    }else if(values[0] == "arena"){
+      config.memArena = values[1] == "1";
+    }else if(values[0] == "spinning"){
+      config.spinning = values[1] == "1";
+    }else if(values[0] == "sec"){
+      valid = parseNumber(values[1], &number);
+      config.sec = number;
+    }else if(values[0] == "threads"){
+      valid = parseNumber(values[1], &number);
+      if(valid && (int)number != sessionThreads){
+        std::cout << getTuningPath(modelPath) << " was tuned with " << (int)number << " threads, not " << sessionThreads << ", using defaults" << std::endl;
+        return Sam3SessionConfig();
+      }
+    }
+  }
+  if(!valid){
+    std::cout << getTuningPath(modelPath) << " is malformed, using defaults" << std::endl;
+    return Sam3SessionConfig();
+  }
+  std::string providerName = config.provider == "xnnpack" ? "XnnpackExecutionProvider" : "DnnlExecutionProvider";
+  std::vector<std::string> available = Ort::GetAvailableProviders();
+  if(config.provider != "cpu" && std::find(available.begin(), available.end(), providerName) == available.end()){
+    std::cout << providerName << " is not available for " << modelPath << ", using cpu" << std::endl;
+    config.provider = "cpu";
+  }
+  return config;
+}
+
+std::unique_ptr<Ort::Session> Sam3::createSession(const std::string& modelPath, const Sam3SessionConfig &config){
+  Ort::SessionOptions options;
+  initSessionOptions(&options, config);
+  bool profiling = tracing;
+  if(profiling){
+    std::string prefix = tracePath + "." + modelPath.substr(modelPath.rfind('/') + 1);
+    options.EnableProfiling(prefix.c_str());
+  }
+  std::unique_ptr<Ort::Session> session = std::make_unique<Ort::Session>(env, modelPath.c_str(), options);
+  if(profiling){
+    std::lock_guard<std::mutex> lock(traceMutex);
+    profiledSessions.insert(session.get());
+  }
+  return session;
+}
+
+// ONNX Runtime writes the profile of a session when it is destroyed, so a profiled session
+// that writeTrace has not ended yet is ended here and its profile removed.
+void Sam3::releaseSession(std::unique_ptr<Ort::Session> *session){
+  if(!*session){
+    return;
+  }
+  bool profiled = false;
+  {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    profiled = profiledSessions.erase(session->get()) > 0;
+  }
+  if(profiled){
+    try{
+      Ort::AllocatorWithDefaultOptions allocator;
+      Ort::AllocatedStringPtr profilePath = (*session)->EndProfilingAllocated(allocator);
+      if(profilePath && std::string(profilePath.get()).size() > 0){
+        std::remove(profilePath.get());
+      }
+    }catch(Ort::Exception& e){
+      std::cout << e.what() << std::endl;
+    }
+  }
+  session->reset();
+}
+
+static bool writeSessionConfig(const std::string& modelPath, const Sam3SessionConfig &config, int threadsNumber){
+  std::ofstream f(getTuningPath(modelPath));
+  if(!f){
+    return false;
+  }
+  f << "provider=" << config.provider << std::endl;
+  f << "optimization=" << config.optimization << std::endl;
+  f << "arena=" << (config.memArena ? 1 : 0) << std::endl;
+  f << "spinning=" << (config.spinning ? 1 : 0) << std::endl;
+  f << "sec=" << config.sec << std::endl;
+  f << "threads=" << threadsNumber << std::endl;
+  return true;
+}
+
+static bool isSameSessionConfig(const Sam3SessionConfig &a, const Sam3SessionConfig &b){
+  return a.provider == b.provider && a.optimization == b.optimization && a.memArena == b.memArena && a.spinning == b.spinning;
+}
+
+// Changes one setting at a time from the current ones and keeps every change that is faster.
+// The session under test is swapped into place, so runStage measures it with the real inputs.
+bool Sam3::tuneSession(const std::string& modelPath, std::unique_ptr<Ort::Session> *session, std::unique_ptr<Ort::Session> *maskSession, std::function<bool()> runStage, int repeats, Sam3SessionConfig *best){
+  auto measure = [&](double *sec){
+    // The first run pays for the arena and the kernel setup
+    if(!runStage()){
+      return false;
+    }
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for(int r = 0; r < repeats; r++){
+      if(!runStage()){
+        return false;
+      }
+    }
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    *sec = (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0 / repeats;
+    return true;
+  };
+  auto printConfig = [&](const Sam3SessionConfig &config, const std::string &result){
+    std::cout << modelPath << " provider=" << config.provider << " optimization=" << config.optimization
+      << " arena=" << config.memArena << " spinning=" << config.spinning << " " << result << std::endl;
+  };
+  bool split = maskSession != nullptr && *maskSession;
+  auto tryConfig = [&](const Sam3SessionConfig &config){
+    if(isSameSessionConfig(config, *best)){
+      return;
+    }
+    std::unique_ptr<Ort::Session> candidate, candidateMask;
+    try{
+      candidate = createSession(modelPath, config);
+      if(split){
+        candidateMask = createSession(getMaskDecoderPath(modelPath), config);
+      }
+    }catch(Ort::Exception& e){
+      printConfig(config, e.what());
+      releaseSession(&candidate);
+      return;
+    }
+    session->swap(candidate);
+    if(split){
+      maskSession->swap(candidateMask);
+    }
+    double sec = 0;
+    bool measured = measure(&sec);
+    if(measured && sec < best->sec){
+      *best = config;
+      best->sec = sec;
+      printConfig(config, "sec = " + std::to_string(sec) + " kept");
+    }else{
+      printConfig(config, measured ? "sec = " + std::to_string(sec) : "failed");
+      session->swap(candidate);
+      if(split){
+        maskSession->swap(candidateMask);
+      }
+    }
+    // The session that lost
+    releaseSession(&candidate);
+    releaseSession(&candidateMask);
+  };
+
+  *best = getSessionConfig(modelPath);
+  if(!measure(&best->sec)){
+    return false;
+  }
+  printConfig(*best, "sec = " + std::to_string(best->sec) + " current");
+  std::vector<std::string> available = Ort::GetAvailableProviders();
+  std::vector<std::string> providers = {"cpu"};
+  if(std::find(available.begin(), available.end(), "XnnpackExecutionProvider") != available.end()){
+    providers.push_back("xnnpack");
+  }
+  if(std::find(available.begin(), available.end(), "DnnlExecutionProvider") != available.end()){
+    providers.push_back("dnnl");
+  }
+  for(int i = 0; i < providers.size(); i++){
+    Sam3SessionConfig config = *best;
+    config.provider = providers[i];
+    tryConfig(config);
+  }
+  std::vector<std::string> optimizations = {"all", "extended", "basic"};
+  for(int i = 0; i < optimizations.size(); i++){
+    Sam3SessionConfig config = *best;
+    config.optimization = optimizations[i];
+    tryConfig(config);
+  }
+  Sam3SessionConfig config = *best;
+  config.memArena = !best->memArena;
+  tryConfig(config);
+  config = *best;
+  config.spinning = !best->spinning;
+  tryConfig(config);
+  return true;
+}
+
+// Tunes the vision encoder, text encoder and decoder of the active resolution one after another
+// on the given image and prompts, keeps the fastest sessions loaded and writes their .tuning files.
+bool Sam3::tuneSessions(const cv::Mat& image, const std::vector<std::string> &text_list, int repeats){
+  if(sessionDevice != "cpu" || resolutionIndex < 0){
+    std::cout << "Tuning needs models loaded on the cpu device" << std::endl;
+    return false;
+  }
+  std::vector<std::string> texts = text_list;
+  std::vector<std::vector<cv::Rect2f>> rects_list;
+  std::vector<std::vector<int>> labels_list;
+  alignTextsAndBoxes(&texts, &rects_list, &labels_list);
+  cv::Size imageSize = getInputSize();
+  Sam3SessionConfig configVision, configText, configDecoder;
+  foreground(true);
+  // Each stage is run again after its tuning so that the next one sees valid inputs
+  bool success = tuneSession(modelPathVision, &visionEncoder, nullptr, [&](){
+      return preprocessImage(image);
+    }, repeats, &configVision) && preprocessImage(image);
+  success = success && tuneSession(modelPathText, &textEncoder, nullptr, [&](){
+      return encodeText(texts);
+    }, repeats, &configText) && encodeText(texts);
+  success = success && tuneSession(modelPathDecoder, &decoder, &maskDecoder, [&](){
+      decode(rects_list, labels_list, 0.5, imageSize, false);
+      return !isDecoderEmpty();
+    }, repeats, &configDecoder);
+  foreground(false);
+  if(!success){
+    return false;
+  }
+  return writeSessionConfig(modelPathVision, configVision, sessionThreads) &&
+    writeSessionConfig(modelPathText, configText, sessionThreads) &&
+    writeSessionConfig(modelPathDecoder, configDecoder, sessionThreads);
+}
+
+// Caches the IO names and derives the vision shapes of the active vision encoder and decoder.
+bool Sam3::initResolution(const std::string& decoderPath){
+  cacheIONames(visionEncoder.get(), cachedInputNamesVision, ptrInputNamesVision,
+                                    cachedOutputNamesVision, ptrOutputNamesVision);
+  cacheIONames(decoder.get(),       cachedInputNamesDecoder, ptrInputNamesDecoder,
+                                    cachedOutputNamesDecoder, ptrOutputNamesDecoder);
+
+  // A score stage decoder has no pred_masks output, its mask stage is exported next to it
+  if(std::find(cachedOutputNamesDecoder.begin(), cachedOutputNamesDecoder.end(), "pred_masks") == cachedOutputNamesDecoder.end()){
+    std::string maskDecoderPath = getMaskDecoderPath(decoderPath);
+    if(!modelExists(maskDecoderPath)){
+      std::cout << "Cannot find the mask decoder for " << decoderPath << std::endl;
+      return false;
+    }
+    // The mask stage is tuned together with the score stage
+    maskDecoder = createSession(maskDecoderPath, getSessionConfig(decoderPath));
+    cacheIONames(maskDecoder.get(), cachedInputNamesMaskDecoder, ptrInputNamesMaskDecoder,
+                                    cachedOutputNamesMaskDecoder, ptrOutputNamesMaskDecoder);
+  }
+
+  inputShapeVision = visionEncoder->GetInputTypeInfo(0).GetTensorTypeAndShapeInfo().GetShape();
+  inputShapeVision[0] = 1;
+  outputShapeVision[3] = visionEncoder->GetOutputTypeInfo(3).GetTensorTypeAndShapeInfo().GetShape();
+  outputShapeVision[3][0] = 1;
+  outputShapeVision[2] = outputShapeVision[3];
+  outputShapeVision[1] = outputShapeVision[3];
+  outputShapeVision[1][2] = outputShapeVision[3][2] * 2;
+  outputShapeVision[1][3] = outputShapeVision[3][3] * 2;
+  outputShapeVision[0] = outputShapeVision[3];
+  outputShapeVision[0][2] = outputShapeVision[3][2] * 4;
+  outputShapeVision[0][3] = outputShapeVision[3][3] * 4;
+
+  // With static shapes the decoder writes straight into outputDecoder, see decode
+  bool staticShapes = !maskDecoder && decoder->GetOutputCount() == 4;
+  for(int i = 0; i < 4 && staticShapes; i++){
+    outputShapeDecoderModel[i] = decoder->GetOutputTypeInfo(i).GetTensorTypeAndShapeInfo().GetShape();
+    for(int j = 1; j < outputShapeDecoderModel[i].size(); j++){
+      staticShapes = staticShapes && outputShapeDecoderModel[i][j] > 0;
+    }
+  }
+  for(int i = 0; i < 4; i++){
+    if(!staticShapes){
+      outputShapeDecoderModel[i].resize(0);
+    }
+  }
+  return true;
+}
+
+void Sam3::swapResolution(Sam3Resolution *resolution){
+  visionEncoder.swap(resolution->visionEncoder);
+  decoder.swap(resolution->decoder);
+  maskDecoder.swap(resolution->maskDecoder);
+  cachedInputNamesVision.swap(resolution->cachedInputNamesVision);
+  cachedOutputNamesVision.swap(resolution->cachedOutputNamesVision);
+  cachedInputNamesDecoder.swap(resolution->cachedInputNamesDecoder);
+  cachedOutputNamesDecoder.swap(resolution->cachedOutputNamesDecoder);
+  cachedInputNamesMaskDecoder.swap(resolution->cachedInputNamesMaskDecoder);
+  cachedOutputNamesMaskDecoder.swap(resolution->cachedOutputNamesMaskDecoder);
+  ptrInputNamesVision.swap(resolution->ptrInputNamesVision);
+  ptrOutputNamesVision.swap(resolution->ptrOutputNamesVision);
+  ptrInputNamesDecoder.swap(resolution->ptrInputNamesDecoder);
+  ptrOutputNamesDecoder.swap(resolution->ptrOutputNamesDecoder);
+  ptrInputNamesMaskDecoder.swap(resolution->ptrInputNamesMaskDecoder);
+  ptrOutputNamesMaskDecoder.swap(resolution->ptrOutputNamesMaskDecoder);
+  inputShapeVision.swap(resolution->inputShapeVision);
+  for(int i = 0; i < 4; i++){
+    outputShapeVision[i].swap(resolution->outputShapeVision[i]);
+    outputShapeDecoderModel[i].swap(resolution->outputShapeDecoderModel[i]);
+  }
+  modelPathVision.swap(resolution->modelPathVision);
+  modelPathDecoder.swap(resolution->modelPathDecoder);
+}
+
+// Loads another exported input size next to the models of loadModel. The text encoder is shared.
+bool Sam3::addResolution(const std::string& visionPath, const std::string& decoderPath){
+  if(resolutionIndex < 0 || !modelExists(visionPath) || !modelExists(decoderPath)){
+    return false;
+  }
+  foreground(true);
+  Sam3Resolution resolution;
+  swapResolution(&resolutions[resolutionIndex]);
+  bool success = false;
+  try{
+    auto futureVision = std::async(std::launch::async, [&](){
+      return createSession(visionPath, getSessionConfig(visionPath));
+    });
+    auto futureDecoder = std::async(std::launch::async, [&](){
+      return createSession(decoderPath, getSessionConfig(decoderPath));
+    });
+    visionEncoder = futureVision.get();
+    decoder       = futureDecoder.get();
+    modelPathVision = visionPath;
+    modelPathDecoder = decoderPath;
+    success = initResolution(decoderPath);
+  }catch(Ort::Exception& e){
+    std::cout << e.what() << std::endl;
+  }catch(std::exception& e){
+    std::cout << e.what() << std::endl;
+  }
+  swapResolution(&resolution);
+  swapResolution(&resolutions[resolutionIndex]);
+  if(!success){
+    releaseSession(&resolution.visionEncoder);
+    releaseSession(&resolution.decoder);
+    releaseSession(&resolution.maskDecoder);
+    foreground(false);
+    return false;
+  }
+  foreground(false);
+  Sam3ResolutionStats stats;
+  stats.inputSize = cv::Size((int)resolution.inputShapeVision[3], (int)resolution.inputShapeVision[2]);
+  resolutions.push_back(std::move(resolution));
+  resolutionStats.push_back(stats);
+  return true;
+}
+
+int Sam3::getResolutionCount(){
+  return (int)resolutions.size();
+}
+
+// The image has to be encoded again after switching, decode refuses embeddings of another resolution.
+bool Sam3::selectResolution(int index){
+  if(index < 0 || index >= resolutions.size()){
+    return false;
+  }
+  if(index == resolutionIndex){
+    return true;
+  }
+  foreground(true);
+  swapResolution(&resolutions[resolutionIndex]);
+  swapResolution(&resolutions[index]);
+  resolutionIndex = index;
+  clearVisionBatch();
+  foreground(false);
+  return true;
+}
+
+// Picks the largest resolution whose encode + decode time fits the budget, but none larger than
+// needed to cover the image. Resolutions without measurements are estimated from the measured
+// seconds per input pixel. With nothing measured yet every estimate is 0 and the budget has no
+// effect, so the smallest resolution covering the image is picked.
+int Sam3::selectResolutionForBudget(double latencyBudgetSec, const cv::Size &imageSize){
+  double measuredSec = 0, measuredPixels = 0;
+  for(int i = 0; i < resolutionStats.size(); i++){
+    const Sam3ResolutionStats &stats = resolutionStats[i];
+    if(stats.encodeCount > 0 && stats.decodeCount > 0){
+      measuredSec += stats.encodeSec / stats.encodeCount + stats.decodeSec / stats.decodeCount;
+      measuredPixels += stats.inputSize.area();
+    }
+  }
+  double secPerPixel = measuredPixels > 0 ? measuredSec / measuredPixels : 0;
+  std::vector<int> order(resolutionStats.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](int i1, int i2){
+    return resolutionStats[i1].inputSize.area() < resolutionStats[i2].inputSize.area();
+  });
+  int chosen = order.size() > 0 ? order[0] : -1;
+  for(int n = 0; n < order.size(); n++){
+    const Sam3ResolutionStats &stats = resolutionStats[order[n]];
+    double sec = secPerPixel * stats.inputSize.area();
+    if(stats.encodeCount > 0 && stats.decodeCount > 0){
+      sec = stats.encodeSec / stats.encodeCount + stats.decodeSec / stats.decodeCount;
+    }
+    if(sec > latencyBudgetSec){
+      break;
+    }
+    chosen = order[n];
+    if(stats.inputSize.width >= imageSize.width && stats.inputSize.height >= imageSize.height){
+      break;
+    }
+  }
+  selectResolution(chosen);
+  return chosen;
+}
+
+std::vector<Sam3ResolutionStats> Sam3::getResolutionStats(){
+  return resolutionStats;
+}
+
+int Sam3::getResolutionIndex(){
+  return resolutionIndex;
+}
+
+void Sam3::setForegroundHook(std::function<void(bool)> hook){
+  foregroundHook = hook;
+}
+
+void Sam3::foreground(bool active){
+  if(foregroundHook){
+    foregroundHook(active);
+  }
+}
+
+// Same clock as the ONNX Runtime profiler, so both sets of events line up.
+static int64_t traceClockUs(){
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+}
+
+// Records spans of every stage and turns on the ONNX Runtime profiler of the sessions created
+// afterwards, so call it before loadModel. writeTrace merges both into one Chrome trace file
+// that Perfetto and chrome://tracing open. An empty path turns tracing off.
+void Sam3::setTraceFile(const std::string& path){
+  std::lock_guard<std::mutex> lock(traceMutex);
+  tracePath = path;
+  traceStartUs = traceClockUs();
+  traceEvents.clear();
+  traceEventsDropped = 0;
+  traceThreads.clear();
+  tracing = path.size() > 0;
+}
+
+// Attached to the spans recorded from now on, e.g. one id per server request.
+void Sam3::setTraceRequestId(int64_t requestId){
+  traceRequestId = requestId;
+}
+
+// Spans kept until the next writeTrace, later ones are only counted in the trace.
+void Sam3::setTraceEventLimit(int limit){
+  std::lock_guard<std::mutex> lock(traceMutex);
+  traceEventLimit = std::max(0, limit);
+}
+
+bool Sam3::isTracing(){
+  return tracing;
+}
+
+int64_t Sam3::getTraceTimeUs(){
+  return traceClockUs() - traceStartUs;
+}
+
+void Sam3::addTraceEvent(const char *name, int64_t startUs, int64_t endUs, int batchSize){
+  std::lock_guard<std::mutex> lock(traceMutex);
+  if(!tracing){
+    return;
+  }
+  if((int)traceEvents.size() >= traceEventLimit){
+    traceEventsDropped++;
+    return;
+  }
+  auto it = traceThreads.find(std::this_thread::get_id());
+  if(it == traceThreads.end()){
+    it = traceThreads.emplace(std::this_thread::get_id(), (int)traceThreads.size()).first;
+  }
+  traceEvents.push_back({name, startUs, endUs - startUs, traceRequestId, batchSize, it->second});
+}
+
+static std::string escapeJson(const std::string &text){
+  std::string escaped;
+  for(int i = 0; i < text.size(); i++){
+    char c = text[i];
+    if(c == '"' || c == '\\'){
+      escaped += '\\';
+      escaped += c;
+    }else if((unsigned char)c < 0x20){
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    }else{
+      escaped += c;
+    }
+  }
+  return escaped;
+}
+
+// Rewrites the number after "key" in one profiler event.
+static void rewriteTraceNumber(std::string *event, const std::string &key, int64_t value, bool add){
+  size_t pos = event->find("\"" + key + "\"");
+  if(pos == std::string::npos){
+    return;
+  }
+  size_t begin = event->find_first_of("-0123456789", pos + key.size() + 2);
+  size_t end = event->find_first_not_of("0123456789", begin + 1);
+  if(begin == std::string::npos || end == std::string::npos){
+    return;
+  }
+  int64_t number = add ? std::stoll(event->substr(begin, end - begin)) + value : value;
+  event->replace(begin, end - begin, std::to_string(number));
+}
+
+// Copies the events of one ONNX Runtime profile, moved to the trace clock and process pid.
+static void appendProfileEvents(const std::string &profilePath, int pid, int64_t offsetUs, std::vector<std::string> *events){
+  std::ifstream f(profilePath);
+  std::stringstream buffer;
+  buffer << f.rdbuf();
+  std::string text = buffer.str();
+  int depth = 0;
+  bool inString = false;
+  size_t begin = 0;
+  for(size_t i = 0; i < text.size(); i++){
+    char c = text[i];
+    if(inString){
+      if(c == '\\'){
+        i++;
+      }else if(c == '"'){
+        inString = false;
+      }
+      continue;
+    }
+    if(c == '"'){
+      inString = true;
+    }else if(c == '{'){
+      if(depth == 0){
+        begin = i;
+      }
+      depth++;
+    }else if(c == '}'){
+      depth--;
+      if(depth == 0){
+        std::string event = text.substr(begin, i + 1 - begin);
+        rewriteTraceNumber(&event, "ts", offsetUs, true);
+        rewriteTraceNumber(&event, "pid", pid, false);
+        events->push_back(event);
+      }
+    }
+  }
+}
+
+// Ends the profiler of every loaded session and writes the Sam3 spans and the operator events
+// of each model, one process per model, to the trace file. Tracing stops afterwards; calling
+// setTraceFile again records spans once more, but operator events only come from sessions
+// created after it, so reload the models for those.
+bool Sam3::writeTrace(){
+  if(!tracing){
+    return false;
+  }
+  foreground(true);
+  tracing = false;
+  std::vector<std::string> events;
+  events.push_back("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"sam3\"}}");
+  {
+    std::lock_guard<std::mutex> lock(traceMutex);
+    for(int i = 0; i < traceEvents.size(); i++){
+      const Sam3TraceEvent &e = traceEvents[i];
+      events.push_back("{\"name\":\"" + escapeJson(e.name) + "\",\"cat\":\"sam3\",\"ph\":\"X\",\"ts\":" + std::to_string(e.startUs) +
+        ",\"dur\":" + std::to_string(e.durationUs) + ",\"pid\":1,\"tid\":" + std::to_string(e.threadIndex) +
+        ",\"args\":{\"request_id\":" + std::to_string(e.requestId) + ",\"batch_size\":" + std::to_string(e.batchSize) + "}}");
+    }
+    if(traceEventsDropped > 0){
+      events.push_back("{\"name\":\"dropped spans\",\"ph\":\"i\",\"s\":\"g\",\"ts\":0,\"pid\":1,\"tid\":0,\"args\":{\"count\":" + std::to_string(traceEventsDropped) + "}}");
+    }
+    traceEvents.clear();
+    traceEventsDropped = 0;
+  }
+  std::vector<std::pair<std::string, Ort::Session*>> sessions = {
+    {modelPathVision, visionEncoder.get()}, {modelPathText, textEncoder.get()},
+    {modelPathDecoder, decoder.get()}, {getMaskDecoderPath(modelPathDecoder), maskDecoder.get()}};
+  for(int i = 0; i < resolutions.size(); i++){
+    const Sam3Resolution &resolution = resolutions[i];
+    sessions.push_back({resolution.modelPathVision, resolution.visionEncoder.get()});
+    sessions.push_back({resolution.modelPathDecoder, resolution.decoder.get()});
+    sessions.push_back({getMaskDecoderPath(resolution.modelPathDecoder), resolution.maskDecoder.get()});
+  }
+  bool success = true;
+  int pid = 2;
+  try{
+    Ort::AllocatorWithDefaultOptions allocator;
+    for(int i = 0; i < sessions.size(); i++){
+      if(sessions[i].second == nullptr){
+        continue;
+      }
+      int64_t offsetUs = (int64_t)(sessions[i].second->GetProfilingStartTimeNs() / 1000) - traceStartUs;
+      Ort::AllocatedStringPtr profilePath = sessions[i].second->EndProfilingAllocated(allocator);
+      {
+        std::lock_guard<std::mutex> lock(traceMutex);
+        profiledSessions.erase(sessions[i].second);
+      }
+      if(!profilePath || std::string(profilePath.get()).size() == 0){
+        continue;
+      }
+      events.push_back("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+        ",\"args\":{\"name\":\"" + escapeJson(sessions[i].first) + "\"}}");
+      appendProfileEvents(profilePath.get(), pid, offsetUs, &events);
+      std::remove(profilePath.get());
+      pid++;
+    }
+  }catch(Ort::Exception& e){
+    std::cout << e.what() << std::endl;
+    success = false;
+  }
+  std::ofstream f(tracePath);
+  f << "{\"traceEvents\":[" << std::endl;
+  for(int i = 0; i < events.size(); i++){
+    f << events[i] << (i + 1 < events.size() ? "," : "") << std::endl;
+  }
+  f << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+  foreground(false);
+  return success && f.good();
+}
+
+Sam3TraceSpan::Sam3TraceSpan(Sam3 *sam3, const char *name, int batchSize) : sam3(sam3), name(name), batchSize(batchSize){
+  if(sam3->isTracing()){
+    startUs = sam3->getTraceTimeUs();
+  }
+}
+
+Sam3TraceSpan::~Sam3TraceSpan(){
+  end();
+}
+
+void Sam3TraceSpan::end(){
+  if(startUs >= 0){
+    sam3->addTraceEvent(name, startUs, sam3->getTraceTimeUs(), batchSize);
+    startUs = -1;
+  }
+}
+
+Sam3ModelProfile Sam3::getModelProfile(){
+  return loadedProfile;
+}
+
 void Sam3::loadingStart(){
   loadingModel = true;
+  foreground(true);
 }
 
 void Sam3::loadingEnd(){
   loadingModel = false;
   terminating = false;
+  foreground(false);
 }
 
 cv::Size Sam3::getInputSize(){
+  if(inputShapeVision.size() < 4){
+    return cv::Size();
+  }
   return cv::Size((int)inputShapeVision[3], (int)inputShapeVision[2]);
 }
 
+void Sam3::initContext(Sam3Context *context){
+  *context = Sam3Context();
+  for(int i = 0; i < 2; i++){
+    context->inputShapeText[i] = inputShapeText[i];
+    context->inputShapeText[i][0] = 1;
+    context->outputShapeText[i] = outputShapeText[i];
+    context->outputShapeText[i][0] = 1;
+  }
+}
+
+// Swapping moves the buffers, a context can be swapped in and out without copying embeddings.
+void Sam3::swapContext(Sam3Context *context){
+  for(int i = 0; i < 4; i++){
+    outputVision[i].swap(context->outputVision[i]);
+    outputShapeVisionBatch[i].swap(context->outputShapeVisionBatch[i]);
+    outputVisionBatch[i].swap(context->outputVisionBatch[i]);
+    outputShapeDecoder[i].swap(context->outputShapeDecoder[i]);
+    outputDecoder[i].swap(context->outputDecoder[i]);
+  }
+  for(int i = 0; i < 2; i++){
+    inputShapeText[i].swap(context->inputShapeText[i]);
+    outputShapeText[i].swap(context->outputShapeText[i]);
+  }
+  outputText0.swap(context->outputText0);
+  outputText1.swap(context->outputText1);
+  for(int i = 0; i < 3; i++){
+    outputShapeDecoderStates[i].swap(context->outputShapeDecoderStates[i]);
+    outputDecoderStates[i].swap(context->outputDecoderStates[i]);
+  }
+  outputShapeDecoderPromptMask.swap(context->outputShapeDecoderPromptMask);
+  outputDecoderPromptMask.swap(context->outputDecoderPromptMask);
+  maskSlots.swap(context->maskSlots);
+  outputScores.swap(context->outputScores);
+  outputBatchIndices.swap(context->outputBatchIndices);
+  std::swap(visionResolution, context->visionResolution);
+  std::swap(scratch, context->scratch);
+}
+
 bool Sam3::preprocessImage(const cv::Mat& image){
+  Sam3TraceSpan span(this, "preprocessImage", 1);
+  std::chrono::steady_clock::time_point begin, end;
+  begin = std::chrono::steady_clock::now();
   try{
     preprocessingStart();
+    clearVisionBatch();
+    visionResolution = -1;
     if(image.size() != cv::Size((int)inputShapeVision[3], (int)inputShapeVision[2])){
       preprocessingEnd();
       return false;
@@ -212,81 +980,196 @@ bool Sam3::preprocessImage(const cv::Mat& image){
       return false;
     }
 
-    // FAST: vectorized OpenCV ops matching Python's (img / 127.5 - 1.0).transpose(2,0,1)
-    cv::Mat imageFloat;
-    image.convertTo(imageFloat, CV_32F, 1.0 / 127.5, -1.0); // bgr float, normalized
-
-    // Split into B, G, R planes and reorder to R, G, B (CHW layout)
-    std::vector<cv::Mat> channels(3);
-    cv::split(imageFloat, channels);  // channels[0]=B, [1]=G, [2]=R
-
-    int64_t planeSize = inputShapeVision[2] * inputShapeVision[3];
-    // Copy R, G, B into CHW tensor (matching Python's channel order)
-    std::memcpy(inputTensorValuesFloat.data() + 0 * planeSize,
-                channels[2].ptr<float>(), planeSize * sizeof(float)); // R
-    std::memcpy(inputTensorValuesFloat.data() + 1 * planeSize,
-                channels[1].ptr<float>(), planeSize * sizeof(float)); // G
-    std::memcpy(inputTensorValuesFloat.data() + 2 * planeSize,
-                channels[0].ptr<float>(), planeSize * sizeof(float)); // B
-
-    auto inputTensor = Ort::Value::CreateTensor<float>(memoryInfo, inputTensorValuesFloat.data(), inputTensorValuesFloat.size(), inputShapeVision.data(), inputShapeVision.size());
-    std::vector<Ort::Value> outputTensors;
-    for(int i = 0; i < 4; i++){
-      outputTensors.push_back(Ort::Value::CreateTensor<float>(
-        memoryInfo, outputVision[i].data(), outputVision[i].size(),
-        outputShapeVision[i].data(), outputShapeVision[i].size()));
-    }
     if(terminating){
       preprocessingEnd();
       return false;
     }
     runOptionsEncoder.UnsetTerminate();
-    visionEncoder->Run(runOptionsEncoder,
-      ptrInputNamesVision.data(),  &inputTensor, 1,
-      ptrOutputNamesVision.data(), outputTensors.data(), outputTensors.size());
+    runVisionEncoder(image, &scratch, outputVision, &runOptionsEncoder);
   }catch(Ort::Exception& e){
     std::cout << e.what() << std::endl;
     preprocessingEnd();
     return false;
   }
   preprocessingEnd();
+  visionResolution = resolutionIndex;
+  end = std::chrono::steady_clock::now();
+  resolutionStats[resolutionIndex].encodeCount++;
+  resolutionStats[resolutionIndex].encodeSec += (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0;
+  return true;
+}
+
+// Writes the four vision outputs into outputs[0..3], sized for the active resolution.
+bool Sam3::runVisionEncoder(const cv::Mat& image, Sam3Scratch *scratch, std::vector<float> *outputs, Ort::RunOptions *runOptions){
+  // FAST: vectorized OpenCV ops matching Python's (img / 127.5 - 1.0).transpose(2,0,1)
+  Sam3TraceSpan spanImage(this, "image to tensor", 1);
+  image.convertTo(scratch->imageFloat, CV_32F, 1.0 / 127.5, -1.0); // bgr float, normalized
+
+  // No-ops unless another resolution was selected since the last image
+  std::vector<float> &inputValues = scratch->inputTensorValuesFloat;
+  inputValues.resize(getShapeSize(inputShapeVision));
+  for(int i = 0; i < 4; i++){
+    outputs[i].resize(getShapeSize(outputShapeVision[i]));
+  }
+
+  // Split B, G, R straight into the R, G, B planes of the CHW tensor (matching Python's channel order)
+  int height = (int)inputShapeVision[2];
+  int width = (int)inputShapeVision[3];
+  int64_t planeSize = inputShapeVision[2] * inputShapeVision[3];
+  cv::Mat channels[3] = {
+    cv::Mat(height, width, CV_32F, inputValues.data() + 2 * planeSize), // B
+    cv::Mat(height, width, CV_32F, inputValues.data() + 1 * planeSize), // G
+    cv::Mat(height, width, CV_32F, inputValues.data() + 0 * planeSize)  // R
+  };
+  cv::split(scratch->imageFloat, channels);
+  spanImage.end();
+
+  auto inputTensor = Ort::Value::CreateTensor<float>(memoryInfo, inputValues.data(), inputValues.size(), inputShapeVision.data(), inputShapeVision.size());
+  std::vector<Ort::Value> &outputTensors = scratch->outputTensors;
+  outputTensors.clear();
+  for(int i = 0; i < 4; i++){
+    outputTensors.push_back(Ort::Value::CreateTensor<float>(
+      memoryInfo, outputs[i].data(), outputs[i].size(),
+      outputShapeVision[i].data(), outputShapeVision[i].size()));
+  }
+  Sam3TraceSpan spanRun(this, "vision encoder run", 1);
+  visionEncoder->Run(*runOptions,
+    ptrInputNamesVision.data(),  &inputTensor, 1,
+    ptrOutputNamesVision.data(), outputTensors.data(), outputTensors.size());
+  outputTensors.clear();
+  return true;
+}
+
+// Encodes into a context with the caller's RunOptions, without touching the Sam3 state.
+// Used off the foreground thread, so it must not call preprocessingStart.
+bool Sam3::encodeImage(const cv::Mat& image, Sam3Context *context, Ort::RunOptions *runOptions){
+  if(image.size() != getInputSize() || image.channels() != 3){
+    return false;
+  }
+  try{
+    context->visionResolution = -1;
+    runVisionEncoder(image, &context->scratch, context->outputVision, runOptions);
+    context->visionResolution = resolutionIndex;
+  }catch(Ort::Exception& e){
+    std::cout << e.what() << std::endl;
+    return false;
+  }
   return true;
 }
 
+void Sam3::swapVisionContext(Sam3Context *context){
+  for(int i = 0; i < 4; i++){
+    outputVision[i].swap(context->outputVision[i]);
+  }
+  std::swap(visionResolution, context->visionResolution);
+  clearVisionBatch();
+}
+
 void Sam3::preprocessingStart(){
   preprocessing = true;
+  foreground(true);
 }
 
 void Sam3::preprocessingEnd(){
   preprocessing = false;
   terminating = false;
+  foreground(false);
+}
+
+// Tokenizing dominates short prompts, the same few class names come back on every image.
+const std::vector<int>& Sam3::getTokenIds(const std::string &text){
+  auto it = tokenCache.find(text);
+  if(it != tokenCache.end()){
+    return it->second;
+  }
+  if(tokenCache.size() >= 4096){
+    tokenCache.clear();
+  }
+  std::vector<int> ids = tokenizer->Encode(text);
+  ids.insert(ids.begin(), 49406);
+  ids.push_back(49407);
+  return tokenCache.emplace(text, std::move(ids)).first->second;
+}
+
+// Like encodeText, but only the texts missing from the cache go through the text encoder.
+// The outputs of the whole list are then assembled from the cache.
+bool Sam3::setTextEmbeddings(const std::vector<std::string> &text_list){
+  Sam3TraceSpan span(this, "setTextEmbeddings", (int)text_list.size());
+  std::vector<std::string> missing;
+  for(int b = 0; b < text_list.size(); b++){
+    if(textCache.find(text_list[b]) == textCache.end() && std::find(missing.begin(), missing.end(), text_list[b]) == missing.end()){
+      missing.push_back(text_list[b]);
+    }
+  }
+  std::vector<float> encodedFeatures;
+  std::vector<uint8_t> encodedMask;
+  if(missing.size() > 0){
+    if(!encodeText(missing)){
+      return false;
+    }
+    encodedFeatures.swap(outputText0);
+    encodedMask.swap(outputText1);
+  }
+  int batchSize = std::max(1, (int)text_list.size());
+  int featureSize = (int)(outputShapeText[0][1] * outputShapeText[0][2]);
+  int maskSize = (int)outputShapeText[1][1];
+  for(int i = 0; i < 2; i++){
+    inputShapeText[i][0] = batchSize;
+    outputShapeText[i][0] = batchSize;
+  }
+  outputText0.resize(getShapeSize(outputShapeText[0]));
+  outputText1.resize(getShapeSize(outputShapeText[1]));
+  for(int b = 0; b < text_list.size(); b++){
+    auto it = std::find(missing.begin(), missing.end(), text_list[b]);
+    if(it != missing.end()){
+      int m = (int)(it - missing.begin());
+      std::memcpy(outputText0.data() + b * featureSize, encodedFeatures.data() + m * featureSize, featureSize * sizeof(float));
+      std::memcpy(outputText1.data() + b * maskSize, encodedMask.data() + m * maskSize, maskSize);
+    }else{
+      const Sam3TextEmbedding &embedding = textCache[text_list[b]];
+      std::memcpy(outputText0.data() + b * featureSize, embedding.features.data(), featureSize * sizeof(float));
+      std::memcpy(outputText1.data() + b * maskSize, embedding.mask.data(), maskSize);
+    }
+  }
+  // Cleared when full like the token cache, the outputs above are already assembled
+  if(textCache.size() + missing.size() > textCacheSize){
+    textCache.clear();
+  }
+  for(int m = 0; m < missing.size() && m < textCacheSize; m++){
+    Sam3TextEmbedding &embedding = textCache[missing[m]];
+    embedding.features.assign(encodedFeatures.begin() + m * featureSize, encodedFeatures.begin() + (m + 1) * featureSize);
+    embedding.mask.assign(encodedMask.begin() + m * maskSize, encodedMask.begin() + (m + 1) * maskSize);
+  }
+  return true;
+}
+
+// Number of prompts setTextEmbeddings keeps, 0 disables the cache.
+void Sam3::setTextCacheSize(int size){
+  textCacheSize = std::max(0, size);
+  textCache.clear();
 }
 
 bool Sam3::encodeText(const std::vector<std::string> &text_list){
+  Sam3TraceSpan span(this, "encodeText", (int)text_list.size());
   try{
     preprocessingStart();
     int batchSize = (int)text_list.size();
     if(batchSize == 0){
       batchSize = 1;
     }
+    Sam3TraceSpan spanTokenize(this, "tokenize", batchSize);
     inputShapeText[0][0] = batchSize;
     inputShapeText[1][0] = batchSize;
     outputShapeText[0][0] = batchSize;
     outputShapeText[1][0] = batchSize;
-    std::vector<int64_t> inputTensorValues[2];
+    std::vector<int64_t> *inputTensorValues = scratch.inputTensorValuesText;
     for(int i = 0; i < 2; i++){
       inputTensorValues[i].resize(getShapeSize(inputShapeText[i]));
     }
     for(int b = 0; b < batchSize; b++){
       int offset = b * (int)inputShapeText[0][1];
-      std::string text = "";
-      if(b < text_list.size()){
-        text = text_list[b];
-      }
-      if(text.length() > 0){
-        std::vector<int> ids = tokenizer->Encode(text);
-        ids.insert(ids.begin(), 49406);
-        ids.push_back(49407);
+      if(b < text_list.size() && text_list[b].length() > 0){
+        const std::vector<int>& ids = getTokenIds(text_list[b]);
         for(int i = 0; i < inputShapeText[0][1]; i++){
           if(i < ids.size()){
             inputTensorValues[0][i + offset] = ids[i];
@@ -296,32 +1179,7 @@ bool Sam3::encodeText(const std::vector<std::string> &text_list){
             inputTensorValues[1][i + offset] = 0;
           }
         }
-      }
-      // if(text.length() > 0){
-      //   std::vector<int> ids_raw = tokenizer->Encode(text);
-
-      //   // Write directly into inputTensorValues without building intermediate ids vector
-      //   int slot = 0;
-      //   auto write = [&](int id, int mask_val){
-      //     if(slot < inputShapeText[0][1]){
-      //       inputTensorValues[0][slot + offset] = id;
-      //       inputTensorValues[1][slot + offset] = mask_val;
-      //       slot++;
-      //     }
-      //   };
-
-      //   write(49406, 1);                          // BOS token
-      //   for(int id : ids_raw) write(id, 1);       // token ids
-      //   write(49407, 1);                          // EOS token
-
-      //   // Pad remainder
-      //   while(slot < inputShapeText[0][1]){
-      //     inputTensorValues[0][slot + offset] = 49407;
-      //     inputTensorValues[1][slot + offset] = 0;
-      //     slot++;
-      //   }
-      // }
-      else{
+      }else{
         for(int i = 0; i < inputShapeText[0][1]; i++){
           inputTensorValues[0][i + offset] = 49407;
           if(i == 0){
@@ -332,15 +1190,18 @@ bool Sam3::encodeText(const std::vector<std::string> &text_list){
         }
       }
     }
-    std::vector<Ort::Value> inputTensors;
+    spanTokenize.end();
+    std::vector<Ort::Value> &inputTensors = scratch.inputTensors;
+    inputTensors.clear();
     for(int i = 0; i < 2; i++){
       inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(memoryInfo, inputTensorValues[i].data(), inputTensorValues[i].size(), inputShapeText[i].data(), inputShapeText[i].size()));
     }
-    outputText0 = std::vector<float>(getShapeSize(outputShapeText[0]));
-    outputText1 = std::vector<uint8_t>(getShapeSize(outputShapeText[1]));
+    outputText0.resize(getShapeSize(outputShapeText[0]));
+    outputText1.resize(getShapeSize(outputShapeText[1]));
     uint8_t *ptrOutputText1 = outputText1.data();
     bool *ptrOutputText1Bool = reinterpret_cast<bool*>(ptrOutputText1);
-    std::vector<Ort::Value> outputTensors;
+    std::vector<Ort::Value> &outputTensors = scratch.outputTensors;
+    outputTensors.clear();
     outputTensors.push_back(Ort::Value::CreateTensor<float>(memoryInfo, outputText0.data(), outputText0.size(), outputShapeText[0].data(), outputShapeText[0].size()));
     outputTensors.push_back(Ort::Value::CreateTensor<bool>(memoryInfo, ptrOutputText1Bool, outputText1.size(), outputShapeText[1].data(), outputShapeText[1].size()));
     if(terminating){
@@ -348,9 +1209,12 @@ bool Sam3::encodeText(const std::vector<std::string> &text_list){
       return false;
     }
     runOptionsEncoder.UnsetTerminate();
+    Sam3TraceSpan spanRun(this, "text encoder run", batchSize);
     textEncoder->Run(runOptionsEncoder,
       ptrInputNamesText.data(),  inputTensors.data(), inputTensors.size(),
       ptrOutputNamesText.data(), outputTensors.data(), outputTensors.size());
+    inputTensors.clear();
+    outputTensors.clear();
   }catch(Ort::Exception& e){
     std::cout << e.what() << std::endl;
     preprocessingEnd();
@@ -387,25 +1251,27 @@ void Sam3::alignTextsAndBoxes(std::vector<std::string> *text_list, std::vector<s
   }
 }
 
-void Sam3::setOutputVisionToInputTensors(int batchSize, std::vector<Ort::Value> *inputTensors){
+// Only the vision outputs from firstIndex are fed, the split score stage needs fpn_feat_2 and fpn_pos_2.
+void Sam3::setOutputVisionToInputTensors(int batchSize, int firstIndex, std::vector<Ort::Value> *inputTensors){
   if(batchSize == 1){
     clearVisionBatch();
-    for(int i = 0; i < 4; i++){
+    for(int i = firstIndex; i < 4; i++){
       (*inputTensors).push_back(Ort::Value::CreateTensor<float>(memoryInfo, outputVision[i].data(), outputVision[i].size(), outputShapeVision[i] .data(), outputShapeVision[i] .size()));
     }
     return;
   }
-  std::vector<int64_t> shape = outputShapeVisionBatch[0];
-  if(shape.size() > 0 && shape[0] == batchSize){
-    return;
-  }
-  clearVisionBatch();
-  for(int i = 0; i < 4; i++){
-    for(int b = 0; b < batchSize; b++){
-      outputVisionBatch[i].insert(outputVisionBatch[i].end(), outputVision[i].begin(), outputVision[i].end());
+  const std::vector<int64_t> &shape = outputShapeVisionBatch[3];
+  if(shape.size() == 0 || shape[0] != batchSize){
+    clearVisionBatch();
+    for(int i = firstIndex; i < 4; i++){
+      for(int b = 0; b < batchSize; b++){
+        outputVisionBatch[i].insert(outputVisionBatch[i].end(), outputVision[i].begin(), outputVision[i].end());
+      }
+      outputShapeVisionBatch[i] = outputShapeVision[i];
+      outputShapeVisionBatch[i][0] = batchSize;
     }
-    outputShapeVisionBatch[i] = outputShapeVision[i];
-    outputShapeVisionBatch[i][0] = batchSize;
+  }
+  for(int i = firstIndex; i < 4; i++){
     (*inputTensors).push_back(Ort::Value::CreateTensor<float>(memoryInfo, outputVisionBatch[i].data(), outputVisionBatch[i].size(), outputShapeVisionBatch[i] .data(), outputShapeVisionBatch[i] .size()));
   }
 }
@@ -414,16 +1280,24 @@ std::tuple<std::vector<cv::Mat>, std::vector<int>> Sam3::decode(const std::vecto
   if(skipDecode){
     return changeThreshold(threshold, imageSize);
   }
+  Sam3TraceSpan span(this, "decode", (int)inputShapeText[0][0]);
   std::chrono::steady_clock::time_point begin, end;
   begin = std::chrono::steady_clock::now();
   preprocessingStart();
   clearDecoder();
   std::vector<cv::Mat> masks;
   std::vector<int> boxes;
+  if(visionResolution != resolutionIndex){
+    std::cout << "The image was encoded with another resolution" << std::endl;
+    preprocessingEnd();
+    return std::make_tuple(std::move(masks), std::move(boxes));
+  }
   try{
     int batchSize = (int)inputShapeText[0][0];
-    std::vector<Ort::Value> inputTensors;
-    setOutputVisionToInputTensors(batchSize, &inputTensors);
+    Sam3TraceSpan spanInputs(this, "decoder inputs", batchSize);
+    std::vector<Ort::Value> &inputTensors = scratch.inputTensors;
+    inputTensors.clear();
+    setOutputVisionToInputTensors(batchSize, maskDecoder ? 2 : 0, &inputTensors);
 
     inputTensors.push_back(Ort::Value::CreateTensor<float>(memoryInfo, outputText0.data(), outputText0.size(), outputShapeText[0].data(), outputShapeText[0].size()));
     uint8_t *ptrOutputText1 = outputText1.data();
@@ -432,16 +1306,17 @@ std::tuple<std::vector<cv::Mat>, std::vector<int>> Sam3::decode(const std::vecto
 
     int boxNumMax = 0;
     for(int b = 0; b < batchSize; b++){
-      std::vector<cv::Rect2f> rects = rects_list[b];
-      if(rects.size() > boxNumMax){
-        boxNumMax = (int)rects.size();
+      if(rects_list[b].size() > boxNumMax){
+        boxNumMax = (int)rects_list[b].size();
       }
     }
     if(boxNumMax == 0){
       boxNumMax = 1;
     }
-    std::vector<float> inputTensorValues0;
-    std::vector<int64_t> inputTensorValues1;
+    std::vector<float> &inputTensorValues0 = scratch.inputTensorValuesBoxes;
+    std::vector<int64_t> &inputTensorValues1 = scratch.inputTensorValuesLabels;
+    inputTensorValues0.clear();
+    inputTensorValues1.clear();
     for(int b = 0; b < batchSize; b++){
       const std::vector<cv::Rect2f>& rects = rects_list[b];
       const std::vector<int>& labels = labels_list[b];
@@ -460,82 +1335,104 @@ std::tuple<std::vector<cv::Mat>, std::vector<int>> Sam3::decode(const std::vecto
         inputTensorValues1.push_back(-10);
       }
     }
-    std::vector<int64_t> inputShape0, inputShape1;
-    inputShape0.push_back(batchSize);
-    inputShape0.push_back(boxNumMax);
-    inputShape0.push_back(4);
-    inputShape1.push_back(batchSize);
-    inputShape1.push_back(boxNumMax);
-    inputTensors.push_back(Ort::Value::CreateTensor<float>(memoryInfo, inputTensorValues0.data(), inputTensorValues0.size(), inputShape0.data(), inputShape0.size()));
-    inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(memoryInfo, inputTensorValues1.data(), inputTensorValues1.size(), inputShape1.data(), inputShape1.size()));
+    int64_t inputShape0[3] = {batchSize, boxNumMax, 4};
+    int64_t inputShape1[2] = {batchSize, boxNumMax};
+    inputTensors.push_back(Ort::Value::CreateTensor<float>(memoryInfo, inputTensorValues0.data(), inputTensorValues0.size(), inputShape0, 3));
+    inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(memoryInfo, inputTensorValues1.data(), inputTensorValues1.size(), inputShape1, 2));
 
+    spanInputs.end();
     if(terminating){
       preprocessingEnd();
-      return std::make_tuple(masks, boxes);
+      return std::make_tuple(std::move(masks), std::move(boxes));
     }
     runOptionsEncoder.UnsetTerminate();
+    Sam3TraceSpan spanRun(this, "decoder run", batchSize);
 
-    // // Allocate output buffers based on actual batch size (done just before this)
-    // for(int i = 0; i < 4; i++){
-    //   outputShapeDecoder[i] = decoder->GetOutputTypeInfo(i).GetTensorTypeAndShapeInfo().GetShape();
-    //   outputShapeDecoder[i][0] = batchSize;
-    // }
-    // outputShapeDecoder[0][2] = outputShapeDecoder[0][3] = outputShapeVision[0][2];
-    // outputShapeDecoder[0][1] = outputShapeDecoder[1][1];
-    // outputShapeDecoder[2][1] = outputShapeDecoder[1][1];
-    // outputShapeDecoder[3][1] = 1;
-    // for(int i = 0; i < 4; i++){
-    //   printShape(outputShapeDecoder[i]);
-    //   outputDecoder[i].resize(getShapeSize(outputShapeDecoder[i]));
-    // }
-
-    // // Pre-bind output tensors so ORT writes directly into outputDecoder — no post-run copy
-    // std::vector<Ort::Value> decoderOutputTensors;
-    // for(int i = 0; i < 4; i++){
-    //   decoderOutputTensors.push_back(Ort::Value::CreateTensor<float>(
-    //     memoryInfo, outputDecoder[i].data(), outputDecoder[i].size(),
-    //     outputShapeDecoder[i].data(), outputShapeDecoder[i].size()));
-    // }
-
-    // decoder->Run(runOptionsEncoder,
-    //   ptrInputNamesDecoder.data(),  inputTensors.data(),          inputTensors.size(),
-    //   ptrOutputNamesDecoder.data(), decoderOutputTensors.data(),  decoderOutputTensors.size());
-
-    auto outputTensors = decoder->Run(runOptionsEncoder,
-      ptrInputNamesDecoder.data(), inputTensors.data(), inputTensors.size(),
-      ptrOutputNamesDecoder.data(), ptrOutputNamesDecoder.size());
-    for(int i = 0; i < 4; i++){
-      auto values = outputTensors[i].GetTensorMutableData<float>();
-      outputShapeDecoder[i] = outputTensors[i].GetTensorTypeAndShapeInfo().GetShape();
-      outputDecoder[i].assign(values, values + getShapeSize(outputShapeDecoder[i]));
+    // Static output shapes: bind outputDecoder so ORT writes into the buffers of the last decode
+    if(outputShapeDecoderModel[0].size() > 0){
+      std::vector<Ort::Value> &outputTensors = scratch.outputTensors;
+      outputTensors.clear();
+      for(int i = 0; i < 4; i++){
+        outputShapeDecoder[i].assign(outputShapeDecoderModel[i].begin(), outputShapeDecoderModel[i].end());
+        outputShapeDecoder[i][0] = batchSize;
+        outputDecoder[i].resize(getShapeSize(outputShapeDecoder[i]));
+        outputTensors.push_back(Ort::Value::CreateTensor<float>(memoryInfo, outputDecoder[i].data(), outputDecoder[i].size(), outputShapeDecoder[i].data(), outputShapeDecoder[i].size()));
+      }
+      decoder->Run(runOptionsEncoder,
+        ptrInputNamesDecoder.data(), inputTensors.data(), inputTensors.size(),
+        ptrOutputNamesDecoder.data(), outputTensors.data(), outputTensors.size());
+      outputTensors.clear();
+    }else{
+      auto outputTensors = decoder->Run(runOptionsEncoder,
+        ptrInputNamesDecoder.data(), inputTensors.data(), inputTensors.size(),
+        ptrOutputNamesDecoder.data(), ptrOutputNamesDecoder.size());
+      if(maskDecoder){
+        // pred_boxes, pred_logits, presence_logits, then the states for the mask stage
+        for(int i = 0; i < 3; i++){
+          auto values = outputTensors[i].GetTensorMutableData<float>();
+          outputShapeDecoder[i + 1] = outputTensors[i].GetTensorTypeAndShapeInfo().GetShape();
+          outputDecoder[i + 1].assign(values, values + getShapeSize(outputShapeDecoder[i + 1]));
+        }
+        for(int i = 0; i < 3; i++){
+          auto values = outputTensors[i + 3].GetTensorMutableData<float>();
+          outputShapeDecoderStates[i] = outputTensors[i + 3].GetTensorTypeAndShapeInfo().GetShape();
+          outputDecoderStates[i].assign(values, values + getShapeSize(outputShapeDecoderStates[i]));
+        }
+        auto promptMask = outputTensors[6].GetTensorMutableData<bool>();
+        outputShapeDecoderPromptMask = outputTensors[6].GetTensorTypeAndShapeInfo().GetShape();
+        outputDecoderPromptMask.assign(promptMask, promptMask + getShapeSize(outputShapeDecoderPromptMask));
+        // Masks are filled by computeMasks, the size is corrected by the first mask stage run
+        outputShapeDecoder[0] = {batchSize, outputShapeDecoder[2][1], outputShapeVision[0][2], outputShapeVision[0][3]};
+        maskSlots.assign(batchSize * outputShapeDecoder[2][1], -1);
+      }else{
+        for(int i = 0; i < 4; i++){
+          auto values = outputTensors[i].GetTensorMutableData<float>();
+          outputShapeDecoder[i] = outputTensors[i].GetTensorTypeAndShapeInfo().GetShape();
+          outputDecoder[i].assign(values, values + getShapeSize(outputShapeDecoder[i]));
+        }
+      }
     }
+    inputTensors.clear();
+    spanRun.end();
 
   }catch(Ort::Exception& e){
     std::cout << e.what() << std::endl;
+    // Bound outputs may hold a partial result
+    clearDecoder();
     preprocessingEnd();
-    return std::make_tuple(masks, boxes);
+    return std::make_tuple(std::move(masks), std::move(boxes));
   }
   preprocessingEnd();
   end = std::chrono::steady_clock::now();
   std::cout << "decode sec = " << (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0 <<std::endl;
+  resolutionStats[resolutionIndex].decodeCount++;
+  resolutionStats[resolutionIndex].decodeSec += (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0;
   return changeThreshold(threshold, imageSize);
 }
 
 std::tuple<std::vector<cv::Mat>, std::vector<int>> Sam3::changeThreshold(float threshold, const cv::Size &imageSize){
+  Sam3TraceSpan span(this, "changeThreshold", outputShapeDecoder[2].size() > 0 ? (int)outputShapeDecoder[2][0] : 0);
   std::chrono::steady_clock::time_point begin, end;
   begin = std::chrono::steady_clock::now();
   preprocessingStart();
   std::vector<cv::Mat> masks;
   std::vector<int> boxes;
-  int batchSize = (int)outputShapeDecoder[0][0];
+  outputScores.resize(0);
+  outputBatchIndices.resize(0);
+  int batchSize = (int)outputShapeDecoder[2][0];
   int scoreSize = (int)outputShapeDecoder[2][1];
   int boxSize = (int)(outputShapeDecoder[1][1] * outputShapeDecoder[1][2]);
-  int maskSize = (int)(outputShapeDecoder[0][1] * outputShapeDecoder[0][2] * outputShapeDecoder[0][3]);
   for(int b = 0; b < batchSize; b++){
     float presence_logits = outputDecoder[3][b];
     float presence_score = 1 / (1 + exp(-presence_logits));
-    std::vector<bool> keep(scoreSize);
-    std::vector<float> scores(scoreSize);
+    // Every score is scaled by presence_score, so nothing in this entry can pass
+    if(presence_score <= threshold){
+      continue;
+    }
+    std::vector<bool> &keep = scratch.keep;
+    std::vector<float> &scores = scratch.scores;
+    keep.resize(scoreSize);
+    scores.resize(scoreSize);
     int count = 0;
     for(int i = 0; i < scoreSize; i++){
       scores[i] = (1 / (1 + exp(-outputDecoder[2][i + b * scoreSize]))) * presence_score;
@@ -546,13 +1443,36 @@ std::tuple<std::vector<cv::Mat>, std::vector<int>> Sam3::changeThreshold(float t
         keep[i] = false;
       }
     }
-    std::vector<int> sort_ids = sort_indexes(scores);
+    std::vector<int> &sort_ids = scratch.sortIds;
+    sort_indexes(scores, &sort_ids);
+    if(maskTopK > 0){
+      int kept = 0;
+      for(int s = 0; s < sort_ids.size(); s++){
+        int k = sort_ids[s];
+        if(keep[k]){
+          keep[k] = kept < maskTopK;
+          kept++;
+        }
+      }
+    }
+    if(maskTopK > 0){
+      count = std::min(count, maskTopK);
+    }
+    // Grown once per batch entry instead of once per detection
+    boxes.reserve(boxes.size() + count * 4);
+    masks.reserve(masks.size() + count);
+    if(maskDecoder){
+      if(!computeMasks(b, keep)){
+        preprocessingEnd();
+        return std::make_tuple(std::vector<cv::Mat>(), std::vector<int>());
+      }
+    }
+    Sam3TraceSpan spanMasks(this, "resize masks", 1);
     for(int s = 0; s < sort_ids.size(); s++){
       int k = sort_ids[s];
       if(!keep[k]){
         continue;
       }
-      std::vector<int> box;
       for (int i = 0; i < 4; i++) {
         float value = outputDecoder[1][k * 4 + i + b * boxSize];
         if(i % 2 == 0){
@@ -560,25 +1480,225 @@ std::tuple<std::vector<cv::Mat>, std::vector<int>> Sam3::changeThreshold(float t
         }else{
           value *= imageSize.height;
         }
-        box.push_back(value);
-      }
-      for (int i = 0; i < 4; i++) {
-        boxes.push_back(box[i]);
+        boxes.push_back(value);
       }
-      // REPLACE the maskf construction + inner loop:
-      cv::Mat maskf((int)outputShapeDecoder[0][2], (int)outputShapeDecoder[0][3], CV_32F,
-                    outputDecoder[0].data() + k * (int)outputShapeDecoder[0][2] * (int)outputShapeDecoder[0][3] + b * maskSize);
-      cv::Mat maskResized;
-      cv::resize(maskf, maskResized, imageSize, 0, 0, cv::INTER_LINEAR);
-      cv::Mat mask(imageSize.height, imageSize.width, CV_8UC1, cv::Scalar(0));
-      mask.setTo(255, maskResized > 0);
+      outputScores.push_back(scores[k]);
+      outputBatchIndices.push_back(b);
+      cv::Mat maskf((int)outputShapeDecoder[0][2], (int)outputShapeDecoder[0][3], CV_32F, getMaskData(b, k));
+      cv::resize(maskf, scratch.maskResized, imageSize, 0, 0, cv::INTER_LINEAR);
+      // Only the returned mask is allocated, it is handed to the caller
+      cv::Mat mask;
+      cv::compare(scratch.maskResized, 0, mask, cv::CMP_GT);
       masks.push_back(mask);
     }
   }
   preprocessingEnd();
   end = std::chrono::steady_clock::now();
   std::cout << "changeThreshold sec = " << (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0 <<std::endl;
-  return std::make_tuple(masks, boxes);
+  return std::make_tuple(std::move(masks), std::move(boxes));
+}
+
+std::vector<float> Sam3::getScores(){
+  return outputScores;
+}
+
+std::vector<int> Sam3::getBatchIndices(){
+  return outputBatchIndices;
+}
+
+// Groups the prompts by type and box count and decodes each group as one batch, so no entry is
+// padded with boxes or text it does not have. Texts come from the text embedding cache, and box
+// only prompts share one empty text. The results are in the order of prompts, an empty vector
+// is returned on error. The decoder state is the one of the last group, so changeThreshold,
+// getScores and getBatchIndices afterwards only cover that group.
+std::vector<Sam3PromptResult> Sam3::decodePrompts(const std::vector<Sam3Prompt> &prompts, float threshold, const cv::Size &imageSize){
+  Sam3TraceSpan span(this, "decodePrompts", (int)prompts.size());
+  std::vector<Sam3PromptResult> results(prompts.size());
+  std::map<std::pair<bool, int>, std::vector<int>> buckets;
+  for(int i = 0; i < prompts.size(); i++){
+    if(prompts[i].labels.size() != prompts[i].rects.size()){
+      std::cout << "decodePrompts: prompt " << i << " has " << prompts[i].rects.size() << " boxes and " << prompts[i].labels.size() << " labels" << std::endl;
+      return std::vector<Sam3PromptResult>();
+    }
+    buckets[std::make_pair(prompts[i].text.empty(), (int)prompts[i].rects.size())].push_back(i);
+  }
+  for(auto &bucket : buckets){
+    const std::vector<int> &indices = bucket.second;
+    std::vector<std::string> text_list;
+    std::vector<std::vector<cv::Rect2f>> rects_list;
+    std::vector<std::vector<int>> labels_list;
+    for(int n = 0; n < indices.size(); n++){
+      const Sam3Prompt &prompt = prompts[indices[n]];
+      text_list.push_back(prompt.text);
+      rects_list.push_back(prompt.rects);
+      labels_list.push_back(prompt.labels);
+    }
+    if(!setTextEmbeddings(text_list)){
+      return std::vector<Sam3PromptResult>();
+    }
+    auto [masks, boxes] = decode(rects_list, labels_list, threshold, imageSize, false);
+    if(isDecoderEmpty()){
+      return std::vector<Sam3PromptResult>();
+    }
+    for(int i = 0; i < masks.size(); i++){
+      Sam3PromptResult &result = results[indices[outputBatchIndices[i]]];
+      result.masks.push_back(masks[i]);
+      result.boxes.insert(result.boxes.end(), boxes.begin() + i * 4, boxes.begin() + i * 4 + 4);
+      result.scores.push_back(outputScores[i]);
+    }
+  }
+  return results;
+}
+
+// Keeps the detections in score order and drops the ones whose mask overlaps a kept detection
+// of another class by more than iouThreshold. Mask bounding rects skip most of the IoU work.
+static void suppressDetections(std::vector<cv::Mat> *masks, std::vector<int> *boxes, std::vector<float> *scores, std::vector<int> *classIds, float iouThreshold){
+  std::vector<int> order = sort_indexes(*scores);
+  std::vector<cv::Rect> rects(masks->size());
+  for(int i = 0; i < masks->size(); i++){
+    rects[i] = cv::boundingRect((*masks)[i]);
+  }
+  std::vector<int> kept;
+  for(int n = 0; n < order.size(); n++){
+    int i = order[n];
+    bool suppressed = false;
+    for(int m = 0; m < kept.size() && !suppressed; m++){
+      int j = kept[m];
+      if((*classIds)[i] == (*classIds)[j] || (rects[i] & rects[j]).area() == 0){
+        continue;
+      }
+      suppressed = calc_mask_iou((*masks)[i], (*masks)[j]) > iouThreshold;
+    }
+    if(!suppressed){
+      kept.push_back(i);
+    }
+  }
+  std::vector<cv::Mat> keptMasks;
+  std::vector<int> keptBoxes, keptClassIds;
+  std::vector<float> keptScores;
+  for(int m = 0; m < kept.size(); m++){
+    int i = kept[m];
+    keptMasks.push_back((*masks)[i]);
+    keptBoxes.insert(keptBoxes.end(), boxes->begin() + i * 4, boxes->begin() + i * 4 + 4);
+    keptScores.push_back((*scores)[i]);
+    keptClassIds.push_back((*classIds)[i]);
+  }
+  masks->swap(keptMasks);
+  boxes->swap(keptBoxes);
+  scores->swap(keptScores);
+  classIds->swap(keptClassIds);
+}
+
+// Detects every class of a large vocabulary with at most chunkSize classes per decoder run, so the
+// vision features are replicated chunkSize times whatever the vocabulary size. Detections are
+// suppressed after every chunk, only the kept masks are carried over. getScores and getBatchIndices
+// then describe the merged detections, the batch index being the position in the vocabulary.
+// The decoder state is the one of the last chunk, changeThreshold does not apply to the merged result.
+std::tuple<std::vector<cv::Mat>, std::vector<int>> Sam3::decodeVocabulary(const std::vector<std::string> &vocabulary, float threshold, const cv::Size &imageSize, int chunkSize, float iouThreshold){
+  Sam3TraceSpan span(this, "decodeVocabulary", (int)vocabulary.size());
+  std::vector<cv::Mat> masks;
+  std::vector<int> boxes;
+  std::vector<float> scores;
+  std::vector<int> classIds;
+  chunkSize = std::max(1, chunkSize);
+  for(int start = 0; start < vocabulary.size(); start += chunkSize){
+    int end = std::min((int)vocabulary.size(), start + chunkSize);
+    std::vector<std::string> chunk(vocabulary.begin() + start, vocabulary.begin() + end);
+    std::vector<std::vector<cv::Rect2f>> rects_list(chunk.size());
+    std::vector<std::vector<int>> labels_list(chunk.size());
+    if(!setTextEmbeddings(chunk)){
+      return std::make_tuple(std::vector<cv::Mat>(), std::vector<int>());
+    }
+    auto [chunkMasks, chunkBoxes] = decode(rects_list, labels_list, threshold, imageSize, false);
+    if(isDecoderEmpty()){
+      return std::make_tuple(std::vector<cv::Mat>(), std::vector<int>());
+    }
+    masks.insert(masks.end(), chunkMasks.begin(), chunkMasks.end());
+    boxes.insert(boxes.end(), chunkBoxes.begin(), chunkBoxes.end());
+    scores.insert(scores.end(), outputScores.begin(), outputScores.end());
+    for(int i = 0; i < outputBatchIndices.size(); i++){
+      classIds.push_back(start + outputBatchIndices[i]);
+    }
+    Sam3TraceSpan spanSuppress(this, "suppress detections", (int)masks.size());
+    suppressDetections(&masks, &boxes, &scores, &classIds, iouThreshold);
+  }
+  // The replicated features of the last chunk are not needed anymore
+  clearVisionBatch();
+  outputScores = scores;
+  outputBatchIndices = classIds;
+  return std::make_tuple(std::move(masks), std::move(boxes));
 }
 
+// Runs the split mask stage for the queries of one batch entry that have no mask yet.
+bool Sam3::computeMasks(int batchIndex, const std::vector<bool> &keep){
+  int scoreSize = (int)outputShapeDecoder[2][1];
+  std::vector<int64_t> &queryIndices = scratch.queryIndices;
+  queryIndices.clear();
+  for(int i = 0; i < scoreSize; i++){
+    if(keep[i] && maskSlots[batchIndex * scoreSize + i] < 0){
+      queryIndices.push_back(i);
+    }
+  }
+  if(queryIndices.size() == 0){
+    return true;
+  }
+  try{
+    std::vector<Ort::Value> &inputTensors = scratch.inputTensors;
+    inputTensors.clear();
+    for(int i = 0; i < 3; i++){
+      inputTensors.push_back(Ort::Value::CreateTensor<float>(memoryInfo, outputVision[i].data(), outputVision[i].size(), outputShapeVision[i].data(), outputShapeVision[i].size()));
+    }
+    // States are at most 4D, the shapes of one batch entry live on the stack
+    int64_t inputShapeStates[3][4];
+    for(int i = 0; i < 3; i++){
+      std::copy(outputShapeDecoderStates[i].begin(), outputShapeDecoderStates[i].end(), inputShapeStates[i]);
+      inputShapeStates[i][0] = 1;
+      int size = getShapeSize(outputShapeDecoderStates[i]) / (int)outputShapeDecoderStates[i][0];
+      inputTensors.push_back(Ort::Value::CreateTensor<float>(memoryInfo, outputDecoderStates[i].data() + batchIndex * size, size, inputShapeStates[i], outputShapeDecoderStates[i].size()));
+    }
+    int64_t inputShapePromptMask[4];
+    std::copy(outputShapeDecoderPromptMask.begin(), outputShapeDecoderPromptMask.end(), inputShapePromptMask);
+    inputShapePromptMask[0] = 1;
+    int sizePromptMask = getShapeSize(outputShapeDecoderPromptMask) / (int)outputShapeDecoderPromptMask[0];
+    bool *ptrPromptMask = reinterpret_cast<bool*>(outputDecoderPromptMask.data()) + batchIndex * sizePromptMask;
+    inputTensors.push_back(Ort::Value::CreateTensor<bool>(memoryInfo, ptrPromptMask, sizePromptMask, inputShapePromptMask, outputShapeDecoderPromptMask.size()));
+    int64_t inputShapeQueries[1] = {(int64_t)queryIndices.size()};
+    inputTensors.push_back(Ort::Value::CreateTensor<int64_t>(memoryInfo, queryIndices.data(), queryIndices.size(), inputShapeQueries, 1));
 
+    runOptionsEncoder.UnsetTerminate();
+    Sam3TraceSpan spanRun(this, "mask decoder run", (int)queryIndices.size());
+    auto outputTensors = maskDecoder->Run(runOptionsEncoder,
+      ptrInputNamesMaskDecoder.data(), inputTensors.data(), inputTensors.size(),
+      ptrOutputNamesMaskDecoder.data(), ptrOutputNamesMaskDecoder.size());
+    inputTensors.clear();
+    std::vector<int64_t> shape = outputTensors[0].GetTensorTypeAndShapeInfo().GetShape();
+    outputShapeDecoder[0][2] = shape[2];
+    outputShapeDecoder[0][3] = shape[3];
+    int maskPlane = (int)(shape[2] * shape[3]);
+    int slot = (int)outputDecoder[0].size() / maskPlane;
+    auto values = outputTensors[0].GetTensorMutableData<float>();
+    outputDecoder[0].insert(outputDecoder[0].end(), values, values + getShapeSize(shape));
+    for(int i = 0; i < queryIndices.size(); i++){
+      maskSlots[batchIndex * scoreSize + queryIndices[i]] = slot + i;
+    }
+  }catch(Ort::Exception& e){
+    std::cout << e.what() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+float* Sam3::getMaskData(int batchIndex, int query){
+  int scoreSize = (int)outputShapeDecoder[2][1];
+  int maskPlane = (int)(outputShapeDecoder[0][2] * outputShapeDecoder[0][3]);
+  int slot = batchIndex * scoreSize + query;
+  if(maskDecoder){
+    slot = maskSlots[slot];
+  }
+  return outputDecoder[0].data() + slot * maskPlane;
+}
+
+// Caps the detections per batch entry, 0 keeps every query above the threshold.
+void Sam3::setMaskTopK(int topK){
+  maskTopK = topK;
+}
@@ -5,23 +5,147 @@
 #include <tokenizers_cpp.h>
 #include <opencv2/core.hpp>
 #include <list>
+#include <map>
+#include <set>
 #include <fstream>
 #include <sstream>
 #include <iostream>
 #include <numeric>
 #include <algorithm>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include "util.h"
 
 using tokenizers::Tokenizer;
 
+// Precision of each exported model: "fp32", "fp16" or "int8".
+struct Sam3ModelProfile {
+  std::string vision = "fp32";
+  std::string text = "fp32";
+  std::string decoder = "fp32";
+};
+
+// Execution provider and session settings of one model on the cpu device. tuneSessions
+// writes the fastest ones next to the model as <model>.tuning, and loadModel reads them back.
+struct Sam3SessionConfig {
+  std::string provider = "cpu";      // cpu, xnnpack or dnnl
+  std::string optimization = "all";  // all, extended or basic
+  bool memArena = true;
+  bool spinning = false;
+  double sec = 0;                    // measured by tuneSessions
+};
+
+// Text encoder output of one prompt, kept by setTextEmbeddings.
+struct Sam3TextEmbedding {
+  std::vector<float> features;
+  std::vector<uint8_t> mask;
+};
+
+// One entry of decodePrompts: a text, boxes normalized like parse_box_list_prompts, or both.
+struct Sam3Prompt {
+  std::string text;
+  std::vector<cv::Rect2f> rects;
+  std::vector<int> labels;
+};
+
+struct Sam3PromptResult {
+  std::vector<cv::Mat> masks;
+  std::vector<int> boxes;
+  std::vector<float> scores;
+};
+
+// One span of the Sam3 stages in the trace, times in microseconds since setTraceFile.
+struct Sam3TraceEvent {
+  const char *name;
+  int64_t startUs;
+  int64_t durationUs;
+  int64_t requestId;
+  int batchSize;
+  int threadIndex;
+};
+
+// Buffers reused across calls, so that repeated calls with the same shapes do not allocate.
+// Sam3 and every Sam3Context own one, which keeps background encodes off the foreground buffers.
+struct Sam3Scratch {
+  std::vector<float> inputTensorValuesFloat;
+  cv::Mat imageFloat;
+  std::vector<int64_t> inputTensorValuesText[2];
+  std::vector<float> inputTensorValuesBoxes;
+  std::vector<int64_t> inputTensorValuesLabels;
+  std::vector<Ort::Value> inputTensors;
+  std::vector<Ort::Value> outputTensors;
+  std::vector<bool> keep;
+  std::vector<float> scores;
+  std::vector<int> sortIds;
+  std::vector<int64_t> queryIndices;
+  cv::Mat maskResized;
+};
+
+// Per-image and per-prompt state, so several callers can share one set of loaded models.
+// initContext prepares a context, swapContext exchanges it with the state of Sam3.
+struct Sam3Context {
+  std::vector<float> outputVision[4];
+  std::vector<int64_t> outputShapeVisionBatch[4];
+  std::vector<float> outputVisionBatch[4];
+  std::vector<int64_t> inputShapeText[2];
+  std::vector<int64_t> outputShapeText[2];
+  std::vector<float> outputText0;
+  std::vector<uint8_t> outputText1;
+  std::vector<int64_t> outputShapeDecoder[4];
+  std::vector<float> outputDecoder[4];
+  std::vector<int64_t> outputShapeDecoderStates[3];
+  std::vector<float> outputDecoderStates[3];
+  std::vector<int64_t> outputShapeDecoderPromptMask;
+  std::vector<uint8_t> outputDecoderPromptMask;
+  std::vector<int> maskSlots;
+  std::vector<float> outputScores;
+  std::vector<int> outputBatchIndices;
+  int visionResolution = -1;
+  Sam3Scratch scratch;
+};
+
+// Vision encoder and decoder exported for one input size. The active resolution lives in
+// the Sam3 members, the others are parked here and swapped in by selectResolution.
+struct Sam3Resolution {
+  std::unique_ptr<Ort::Session> visionEncoder, decoder, maskDecoder;
+  std::vector<std::string> cachedInputNamesVision, cachedOutputNamesVision;
+  std::vector<std::string> cachedInputNamesDecoder, cachedOutputNamesDecoder;
+  std::vector<std::string> cachedInputNamesMaskDecoder, cachedOutputNamesMaskDecoder;
+  std::vector<const char*> ptrInputNamesVision, ptrOutputNamesVision;
+  std::vector<const char*> ptrInputNamesDecoder, ptrOutputNamesDecoder;
+  std::vector<const char*> ptrInputNamesMaskDecoder, ptrOutputNamesMaskDecoder;
+  std::vector<int64_t> inputShapeVision;
+  std::vector<int64_t> outputShapeVision[4];
+  std::vector<int64_t> outputShapeDecoderModel[4];
+  std::string modelPathVision, modelPathDecoder;
+};
+
+struct Sam3ResolutionStats {
+  cv::Size inputSize;
+  int encodeCount = 0;
+  double encodeSec = 0;
+  int decodeCount = 0;
+  double decodeSec = 0;
+};
+
 class Sam3 {
   std::unique_ptr<Ort::Session> visionEncoder, textEncoder, decoder;
+  // Set when the decoder was exported with --split-decoder; decoder is then the score stage.
+  std::unique_ptr<Ort::Session> maskDecoder;
   std::unique_ptr<Tokenizer> tokenizer;
   Ort::Env env;
-  Ort::SessionOptions sessionOptions;
+  std::string sessionDevice = "cpu";
+  int sessionThreads = 1;
+  std::string modelPathVision, modelPathText, modelPathDecoder;
   Ort::RunOptions runOptionsEncoder;
   Ort::MemoryInfo memoryInfo{Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault)};
-  std::vector<float> inputTensorValuesFloat;  // add this
+  Sam3Scratch scratch;
+  // BOS + token ids + EOS of the texts seen so far
+  std::map<std::string, std::vector<int>> tokenCache;
+  std::map<std::string, Sam3TextEmbedding> textCache;
+  int textCacheSize = 1024;
   std::vector<int64_t> inputShapeVision;
   std::vector<int64_t> outputShapeVision[4];
   std::vector<int64_t> outputShapeVisionBatch[4];
@@ -33,15 +157,51 @@ class Sam3 {
   std::vector<uint8_t> outputText1;
   std::vector<int64_t> outputShapeDecoder[4];
   std::vector<float> outputDecoder[4];
+  // Decoder output shapes for batch size 1, empty when the model has dynamic dimensions
+  std::vector<int64_t> outputShapeDecoderModel[4];
+  // Split decoder: score stage states kept for the mask stage, and the
+  // outputDecoder[0] slot of each batch * query mask, -1 until computed.
+  std::vector<int64_t> outputShapeDecoderStates[3];
+  std::vector<float> outputDecoderStates[3];
+  std::vector<int64_t> outputShapeDecoderPromptMask;
+  std::vector<uint8_t> outputDecoderPromptMask;
+  std::vector<int> maskSlots;
+  int maskTopK = 0;
+  std::vector<Sam3Resolution> resolutions;
+  std::vector<Sam3ResolutionStats> resolutionStats;
+  int resolutionIndex = -1;
+  // Resolution the current outputVision was encoded with
+  int visionResolution = -1;
+  std::vector<float> outputScores;
+  // Batch entry of each detection returned by changeThreshold
+  std::vector<int> outputBatchIndices;
+  Sam3ModelProfile loadedProfile;
 
   std::vector<std::string> cachedInputNamesVision, cachedOutputNamesVision;
   std::vector<std::string> cachedInputNamesText,   cachedOutputNamesText;
   std::vector<std::string> cachedInputNamesDecoder, cachedOutputNamesDecoder;
+  std::vector<std::string> cachedInputNamesMaskDecoder, cachedOutputNamesMaskDecoder;
   // char* pointer vectors — rebuilt once from the above, reused every Run()
   std::vector<const char*> ptrInputNamesVision, ptrOutputNamesVision;
   std::vector<const char*> ptrInputNamesText,   ptrOutputNamesText;
   std::vector<const char*> ptrInputNamesDecoder, ptrOutputNamesDecoder;
+  std::vector<const char*> ptrInputNamesMaskDecoder, ptrOutputNamesMaskDecoder;
 
+  // Called with true when a foreground call starts and false when it ends
+  std::function<void(bool)> foregroundHook;
+  // Tracing, see setTraceFile
+  std::string tracePath;
+  std::atomic<bool> tracing{false};
+  std::atomic<int64_t> traceRequestId{0};
+  int64_t traceStartUs = 0;
+  std::mutex traceMutex;
+  std::vector<Sam3TraceEvent> traceEvents;
+  // Spans past the limit are counted instead of kept, so a long running server stays bounded
+  int traceEventLimit = 1000000;
+  int64_t traceEventsDropped = 0;
+  std::map<std::thread::id, int> traceThreads;
+  // Sessions created with the ONNX Runtime profiler that writeTrace has not ended yet
+  std::set<Ort::Session*> profiledSessions;
   bool loadingModel = false;
   bool preprocessing = false;
   bool terminating = false;
@@ -54,17 +214,69 @@ class Sam3 {
   bool isDecoderEmpty();
   void terminatePreprocessing();
   bool loadModel(const std::string& visionPath, const std::string& textPath, const std::string& decoderPath, const std::string& tokenizerPath, int threadsNumber, const std::string device);
+  bool loadModel(const std::string& modelDir, const Sam3ModelProfile& profile, const std::string& tokenizerPath, int threadsNumber, const std::string device);
+  void initSessionOptions(Ort::SessionOptions *options, const Sam3SessionConfig &config);
+  Sam3SessionConfig getSessionConfig(const std::string& modelPath);
+  std::unique_ptr<Ort::Session> createSession(const std::string& modelPath, const Sam3SessionConfig &config);
+  void releaseSession(std::unique_ptr<Ort::Session> *session);
+  bool tuneSession(const std::string& modelPath, std::unique_ptr<Ort::Session> *session, std::unique_ptr<Ort::Session> *maskSession, std::function<bool()> runStage, int repeats, Sam3SessionConfig *best);
+  bool tuneSessions(const cv::Mat& image, const std::vector<std::string> &text_list, int repeats);
+  bool initResolution(const std::string& decoderPath);
+  void swapResolution(Sam3Resolution *resolution);
+  bool addResolution(const std::string& visionPath, const std::string& decoderPath);
+  int getResolutionCount();
+  bool selectResolution(int index);
+  int selectResolutionForBudget(double latencyBudgetSec, const cv::Size &imageSize);
+  std::vector<Sam3ResolutionStats> getResolutionStats();
+  int getResolutionIndex();
+  void setForegroundHook(std::function<void(bool)> hook);
+  void setTraceFile(const std::string& path);
+  void setTraceRequestId(int64_t requestId);
+  void setTraceEventLimit(int limit);
+  bool isTracing();
+  int64_t getTraceTimeUs();
+  void addTraceEvent(const char *name, int64_t startUs, int64_t endUs, int batchSize);
+  bool writeTrace();
+  void foreground(bool active);
+  Sam3ModelProfile getModelProfile();
   void loadingStart();
   void loadingEnd();
   cv::Size getInputSize();
+  void initContext(Sam3Context *context);
+  void swapContext(Sam3Context *context);
   bool preprocessImage(const cv::Mat& image);
+  bool runVisionEncoder(const cv::Mat& image, Sam3Scratch *scratch, std::vector<float> *outputs, Ort::RunOptions *runOptions);
+  bool encodeImage(const cv::Mat& image, Sam3Context *context, Ort::RunOptions *runOptions);
+  void swapVisionContext(Sam3Context *context);
   void preprocessingStart();
   void preprocessingEnd();
+  const std::vector<int>& getTokenIds(const std::string &text);
   bool encodeText(const std::vector<std::string> &text_list);
+  bool setTextEmbeddings(const std::vector<std::string> &text_list);
+  void setTextCacheSize(int size);
   void alignTextsAndBoxes(std::vector<std::string> *text_list, std::vector<std::vector<cv::Rect2f>> *rects_list, std::vector<std::vector<int>> *labels_list);
-  void setOutputVisionToInputTensors(int batchSize, std::vector<Ort::Value> *inputTensors);
+  void setOutputVisionToInputTensors(int batchSize, int firstIndex, std::vector<Ort::Value> *inputTensors);
   std::tuple<std::vector<cv::Mat>, std::vector<int>> decode(const std::vector<std::vector<cv::Rect2f>> &rects_list, const std::vector<std::vector<int>> &labels_list, float threshold, const cv::Size &imageSize, bool skipDecode);
   std::tuple<std::vector<cv::Mat>, std::vector<int>> changeThreshold(float threshold, const cv::Size &imageSize);
+  std::vector<Sam3PromptResult> decodePrompts(const std::vector<Sam3Prompt> &prompts, float threshold, const cv::Size &imageSize);
+  std::tuple<std::vector<cv::Mat>, std::vector<int>> decodeVocabulary(const std::vector<std::string> &vocabulary, float threshold, const cv::Size &imageSize, int chunkSize, float iouThreshold);
+  bool computeMasks(int batchIndex, const std::vector<bool> &keep);
+  float* getMaskData(int batchIndex, int query);
+  void setMaskTopK(int topK);
+  std::vector<float> getScores();
+  std::vector<int> getBatchIndices();
+};
+
+// Records a span from construction to end() or destruction. Costs one flag check unless tracing.
+class Sam3TraceSpan {
+  Sam3 *sam3;
+  const char *name;
+  int batchSize;
+  int64_t startUs = -1;
+ public:
+  Sam3TraceSpan(Sam3 *sam3, const char *name, int batchSize);
+  ~Sam3TraceSpan();
+  void end();
 };
 
 #endif
@@ -0,0 +1,317 @@
+#include <gflags/gflags.h>
+#include <thread>
+#include <map>
+#include <opencv2/opencv.hpp>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "sam3.h"
+#include "allocation.h"
+
+DEFINE_string(vision_encoder, "sam3/vision-encoder.onnx", "Path to the viion encoder model");
+DEFINE_string(text_encoder, "sam3/text-encoder.onnx", "Path to the text encoder model");
+DEFINE_string(decoder, "sam3/decoder.onnx", "Path to the decoder model");
+DEFINE_string(tokenizer, "sam3/tokenizer.json", "Path to the tokenizer");
+DEFINE_string(device, "cpu", "cpu or cuda:0(1,2,3...)");
+DEFINE_string(socket, "/tmp/sam3.sock", "Path to the Unix domain socket");
+DEFINE_string(trace, "", "Trace every request, write_trace saves the Chrome trace to this file");
+DEFINE_bool(count_allocations, false, "Print the heap allocations of every request");
+
+// One session per connection. The embeddings stay in the context between requests,
+// the mask segment is owned by the server and rewritten by every decode.
+struct Session {
+  Sam3Context context;
+  cv::Size imageSize;
+  std::vector<std::vector<cv::Rect2f>> rects_list;
+  std::vector<std::vector<int>> labels_list;
+  std::string buffer;
+  std::string maskName;
+  void *maskData = nullptr;
+  size_t maskSize = 0;
+};
+
+// Swaps the session state into Sam3 for the duration of one request.
+class ContextScope {
+  Sam3 *sam3;
+  Sam3Context *context;
+ public:
+  ContextScope(Sam3 *sam3, Sam3Context *context) : sam3(sam3), context(context){
+    sam3->swapContext(context);
+  }
+  ~ContextScope(){
+    sam3->swapContext(context);
+  }
+};
+
+void releaseMasks(Session *session){
+  if(session->maskData != nullptr){
+    munmap(session->maskData, session->maskSize);
+    session->maskData = nullptr;
+    session->maskSize = 0;
+  }
+  if(session->maskName.size() > 0){
+    shm_unlink(session->maskName.c_str());
+  }
+}
+
+// Larger images are rejected before the segment size is computed
+const int maxImageSide = 32768;
+
+// Resizes straight out of the client segment, the full size pixels are never copied.
+// The segment must hold the whole image, a short one would fault inside cv::resize.
+bool readImage(const std::string &name, int width, int height, const cv::Size &inputSize, cv::Mat *image){
+  if(width <= 0 || height <= 0 || width > maxImageSide || height > maxImageSide){
+    return false;
+  }
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if(fd < 0){
+    return false;
+  }
+  size_t size = (size_t)width * height * 3;
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < 0 || (size_t)st.st_size < size){
+    close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED){
+    return false;
+  }
+  cv::Mat shared(height, width, CV_8UC3, data);
+  cv::resize(shared, *image, inputSize);
+  munmap(data, size);
+  return true;
+}
+
+// Masks are written back to back, each imageSize.width * imageSize.height bytes.
+bool writeMasks(Session *session, const std::vector<cv::Mat> &masks){
+  size_t maskBytes = (size_t)session->imageSize.area();
+  size_t size = std::max<size_t>(1, maskBytes * masks.size());
+  if(session->maskData != nullptr){
+    munmap(session->maskData, session->maskSize);
+    session->maskData = nullptr;
+  }
+  // macOS only sizes a new shm object once, so every reply gets a fresh segment under the same name
+  shm_unlink(session->maskName.c_str());
+  int fd = shm_open(session->maskName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(fd < 0){
+    return false;
+  }
+  if(ftruncate(fd, size) != 0){
+    close(fd);
+    return false;
+  }
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED){
+    return false;
+  }
+  session->maskData = data;
+  session->maskSize = size;
+  for(int i = 0; i < masks.size(); i++){
+    std::memcpy((uint8_t*)data + i * maskBytes, masks[i].data, maskBytes);
+  }
+  return true;
+}
+
+std::string joinBoxes(const std::vector<int> &boxes){
+  std::string text = "";
+  for(int i = 0; i < boxes.size(); i++){
+    text += (i > 0 ? "," : "") + std::to_string(boxes[i]);
+  }
+  return text;
+}
+
+std::string joinScores(const std::vector<float> &scores){
+  std::string text = "";
+  for(int i = 0; i < scores.size(); i++){
+    text += (i > 0 ? "," : "") + std::to_string(scores[i]);
+  }
+  return text;
+}
+
+std::string handleRequest(Sam3 *sam3, Session *session, const std::string &line){
+  std::vector<std::string> fields = split(line, '\t');
+  if(fields.size() == 0){
+    return "error\tempty request";
+  }
+  const std::string &command = fields[0];
+  if(command == "write_trace"){
+    if(!sam3->writeTrace()){
+      return "error\ttracing is off";
+    }
+    // Keep recording spans for the next write_trace, which overwrites the file
+    sam3->setTraceFile(FLAGS_trace);
+    return "ok\t" + FLAGS_trace;
+  }
+  if(command == "encode_image"){
+    if(fields.size() != 4){
+      return "error\tencode_image <shm_name> <width> <height>";
+    }
+    cv::Mat image;
+    cv::Size imageSize(std::stoi(fields[2]), std::stoi(fields[3]));
+    if(!readImage(fields[1], imageSize.width, imageSize.height, sam3->getInputSize(), &image)){
+      return "error\tcannot map " + fields[1];
+    }
+    session->imageSize = imageSize;
+    ContextScope scope(sam3, &session->context);
+    if(!sam3->preprocessImage(image)){
+      return "error\tpreprocessImage";
+    }
+    return "ok";
+  }
+  if(command == "encode_text"){
+    if(session->imageSize.area() == 0){
+      return "error\tencode_image first";
+    }
+    std::string text = fields.size() > 1 ? fields[1] : "";
+    std::string boxes = fields.size() > 2 ? fields[2] : "";
+    std::vector<std::string> text_list = split(text, ',');
+    std::tie(session->rects_list, session->labels_list) = parse_box_list_prompts(boxes, session->imageSize);
+    ContextScope scope(sam3, &session->context);
+    sam3->alignTextsAndBoxes(&text_list, &session->rects_list, &session->labels_list);
+    if(!sam3->encodeText(text_list)){
+      return "error\tencodeText";
+    }
+    return "ok";
+  }
+  if(command == "decode" || command == "change_threshold"){
+    if(fields.size() != 2){
+      return "error\t" + command + " <threshold>";
+    }
+    bool skipDecode = command == "change_threshold";
+    std::vector<cv::Mat> masks;
+    std::vector<int> boxes;
+    std::vector<float> scores;
+    {
+      ContextScope scope(sam3, &session->context);
+      if(skipDecode && sam3->isDecoderEmpty()){
+        return "error\tdecode first";
+      }
+      std::tie(masks, boxes) = sam3->decode(session->rects_list, session->labels_list, std::stof(fields[1]), session->imageSize, skipDecode);
+      scores = sam3->getScores();
+    }
+    if(!writeMasks(session, masks)){
+      return "error\tcannot write masks";
+    }
+    return "ok\t" + std::to_string(masks.size()) + "\t" + session->maskName + "\t" +
+      std::to_string(session->imageSize.width) + "\t" + std::to_string(session->imageSize.height) + "\t" +
+      joinBoxes(boxes) + "\t" + joinScores(scores);
+  }
+  return "error\tunknown command " + command;
+}
+
+bool sendAll(int fd, const std::string &text){
+  size_t sent = 0;
+  while(sent < text.size()){
+    ssize_t n = send(fd, text.data() + sent, text.size() - sent, 0);
+    if(n <= 0){
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineNonHelpFlags(&argc, &argv, true);
+  signal(SIGPIPE, SIG_IGN);
+  Sam3 sam3;
+  sam3.setTraceFile(FLAGS_trace);
+  std::cout<<"loadModel started"<<std::endl;
+  if(!sam3.loadModel(FLAGS_vision_encoder, FLAGS_text_encoder, FLAGS_decoder, FLAGS_tokenizer, std::thread::hardware_concurrency(), FLAGS_device)){
+    std::cout<<"loadModel error"<<std::endl;
+    return 1;
+  }
+
+  int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(listenFd < 0 || FLAGS_socket.size() >= sizeof(addr.sun_path)){
+    std::cout<<"socket error"<<std::endl;
+    return 1;
+  }
+  std::strncpy(addr.sun_path, FLAGS_socket.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(FLAGS_socket.c_str());
+  if(bind(listenFd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 16) != 0){
+    std::cout<<"Cannot listen on "<<FLAGS_socket<<std::endl;
+    return 1;
+  }
+  std::cout<<"Listening on "<<FLAGS_socket<<std::endl;
+
+  // Requests are served one at a time, the models run with the whole thread pool.
+  std::map<int, Session> sessions;
+  int sessionCount = 0;
+  int64_t requestCount = 0;
+  while(true){
+    std::vector<pollfd> fds;
+    fds.push_back({listenFd, POLLIN, 0});
+    for(auto &it : sessions){
+      fds.push_back({it.first, POLLIN, 0});
+    }
+    if(poll(fds.data(), fds.size(), -1) < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      break;
+    }
+    if(fds[0].revents & POLLIN){
+      int clientFd = accept(listenFd, nullptr, nullptr);
+      if(clientFd >= 0){
+        Session &session = sessions[clientFd];
+        sam3.initContext(&session.context);
+        session.maskName = "/sam3-" + std::to_string(getpid()) + "-" + std::to_string(sessionCount++);
+      }
+    }
+    for(int i = 1; i < fds.size(); i++){
+      if(fds[i].revents == 0){
+        continue;
+      }
+      int fd = fds[i].fd;
+      Session &session = sessions[fd];
+      char chunk[4096];
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      bool closing = n <= 0;
+      if(!closing){
+        session.buffer.append(chunk, n);
+      }
+      size_t pos;
+      while(!closing && (pos = session.buffer.find('\n')) != std::string::npos){
+        std::string line = session.buffer.substr(0, pos);
+        session.buffer.erase(0, pos + 1);
+        if(line == "close"){
+          closing = true;
+          break;
+        }
+        std::string reply;
+        sam3.setTraceRequestId(++requestCount);
+        long allocationsBefore = getAllocationCount();
+        try{
+          reply = handleRequest(&sam3, &session, line);
+        }catch(std::exception& e){
+          reply = std::string("error\t") + e.what();
+        }
+        if(FLAGS_count_allocations){
+          std::cout << line.substr(0, line.find('\t')) << " allocations = " << getAllocationCount() - allocationsBefore << std::endl;
+        }
+        closing = !sendAll(fd, reply + "\n");
+      }
+      if(closing){
+        releaseMasks(&session);
+        close(fd);
+        sessions.erase(fd);
+      }
+    }
+  }
+  close(listenFd);
+  unlink(FLAGS_socket.c_str());
+  return 0;
+}
@@ -2,6 +2,8 @@
 #include <thread>
 #include <opencv2/opencv.hpp>
 #include "sam3.h"
+#include "prefetch.h"
+#include "allocation.h"
 
 DEFINE_string(vision_encoder, "sam3/vision-encoder.onnx", "Path to the viion encoder model");
 DEFINE_string(text_encoder, "sam3/text-encoder.onnx", "Path to the text encoder model");
@@ -12,10 +14,94 @@ DEFINE_string(boxes, "", "Boxes prompt");
 DEFINE_double(threshold, 0.5, "Threshold for detections");
 DEFINE_string(image, "david-tomaseti-Vw2HZQ1FGjU-unsplash.jpg", "Path to the image");
 DEFINE_string(device, "cpu", "cpu or cuda:0(1,2,3...)");
+DEFINE_string(resolutions, "", "Extra vision_encoder:decoder pairs separated by ;");
+DEFINE_double(latency_budget, 0, "Pick the resolution for this many seconds, 0 keeps the first");
+DEFINE_int32(mask_top_k, 0, "Maximum detections per prompt, 0 for no limit");
+DEFINE_string(vocabulary, "", "File with one class per line, detects all of them instead of -text");
+DEFINE_int32(vocabulary_chunk, 16, "Classes per decoder run in the vocabulary mode");
+DEFINE_double(vocabulary_iou, 0.7, "Mask IoU above which detections of different classes are suppressed");
+DEFINE_bool(bucket_prompts, false, "Decode the prompts grouped by box count instead of as one padded batch");
+DEFINE_string(trace, "", "Write a Chrome trace of the stages and the model operators to this file");
+DEFINE_bool(count_allocations, false, "Repeat each stage and print the heap allocations of the repeated call");
+DEFINE_string(prefetch, "", "Comma separated images to walk through with Sam3Prefetcher instead of -image");
+DEFINE_int32(prefetch_depth, 2, "Images encoded ahead in the prefetch mode");
+DEFINE_int32(prefetch_dwell_ms, 500, "Time spent on each image in the prefetch mode before moving on");
+
+void printAllocations(const std::string &stage, std::function<void()> run){
+  run();
+  long before = getAllocationCount();
+  run();
+  std::cout << stage << " allocations = " << getAllocationCount() - before << std::endl;
+}
+
+int writeTrace(Sam3 *sam3){
+  if(FLAGS_trace.size() > 0){
+    if(!sam3->writeTrace()){
+      std::cout<<"writeTrace error"<<std::endl;
+      return 1;
+    }
+    std::cout<<"Trace written to "<<FLAGS_trace<<std::endl;
+  }
+  return 0;
+}
+
+// Walks through the images like a user would. The foreground encodeText, decode and changeThreshold
+// of each image preempt the background encode of the next ones, and -latency_budget switches the
+// resolution under the prefetcher.
+int runPrefetch(Sam3 *sam3){
+  std::vector<std::string> paths = split(FLAGS_prefetch, ',');
+  Sam3Prefetcher prefetcher(sam3);
+  std::chrono::steady_clock::time_point begin, end;
+  int hits = 0;
+  for(int n = 0; n < paths.size(); n++){
+    begin = std::chrono::steady_clock::now();
+    prefetcher.setImages(paths, n, FLAGS_prefetch_depth);
+    cv::Mat image = cv::imread(paths[n], cv::IMREAD_COLOR);
+    if(image.empty()){
+      std::cout<<"Cannot read "<<paths[n]<<std::endl;
+      return 1;
+    }
+    cv::Size imageSize = cv::Size(image.cols, image.rows);
+    if(FLAGS_latency_budget > 0){
+      sam3->selectResolutionForBudget(FLAGS_latency_budget, imageSize);
+    }
+    Sam3Context context;
+    cv::Size prefetchedSize;
+    bool hit = prefetcher.take(paths[n], &context, &prefetchedSize);
+    if(hit){
+      sam3->swapVisionContext(&context);
+      hits++;
+    }else{
+      cv::resize(image, image, sam3->getInputSize());
+      if(!sam3->preprocessImage(image)){
+        std::cout<<"preprocessImage error"<<std::endl;
+        return 1;
+      }
+    }
+    end = std::chrono::steady_clock::now();
+    std::cout<<paths[n]<<(hit ? " hit" : " miss")<<" resolution "<<sam3->getResolutionIndex()<<" image sec = "<<(std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0<<std::endl;
+    std::vector<std::string> text_list = split(FLAGS_text, ',');
+    auto [rects_list, labels_list] = parse_box_list_prompts(FLAGS_boxes, imageSize);
+    sam3->alignTextsAndBoxes(&text_list, &rects_list, &labels_list);
+    if(!sam3->encodeText(text_list)){
+      std::cout<<"Encode text error"<<std::endl;
+      return 1;
+    }
+    auto [masks, boxes] = sam3->decode(rects_list, labels_list, FLAGS_threshold, imageSize, false);
+    std::cout<<"Found "<<masks.size()<<std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_prefetch_dwell_ms / 2));
+    // A second foreground call while the next image is encoding
+    std::tie(masks, boxes) = sam3->decode(rects_list, labels_list, FLAGS_threshold, imageSize, true);
+    std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_prefetch_dwell_ms / 2));
+  }
+  std::cout<<"hits "<<hits<<" of "<<paths.size()<<std::endl;
+  return 0;
+}
 
 int main(int argc, char** argv) {
   gflags::ParseCommandLineNonHelpFlags(&argc, &argv, true);
   Sam3 sam3;
+  sam3.setTraceFile(FLAGS_trace);
   std::chrono::steady_clock::time_point begin, end, begin_total, end_total; 
   std::cout<<"loadModel started"<<std::endl;
   begin = std::chrono::steady_clock::now();
@@ -26,11 +112,28 @@ int main(int argc, char** argv) {
     std::cout<<"loadModel error"<<std::endl;
     return 1;
   }
+  std::vector<std::string> resolutions = split(FLAGS_resolutions, ';');
+  for(int i = 0; i < resolutions.size(); i++){
+    std::vector<std::string> paths = split(resolutions[i], ':');
+    if(paths.size() != 2 || !sam3.addResolution(paths[0], paths[1])){
+      std::cout<<"addResolution error "<<resolutions[i]<<std::endl;
+      return 1;
+    }
+  }
+  if(FLAGS_prefetch.size() > 0){
+    if(runPrefetch(&sam3) != 0){
+      return 1;
+    }
+    return writeTrace(&sam3);
+  }
   begin_total = std::chrono::steady_clock::now();
   std::cout<<"preprocessImage started"<<std::endl;
   begin = std::chrono::steady_clock::now();
   cv::Mat image = cv::imread(FLAGS_image, cv::IMREAD_COLOR);
   cv::Size imageSize = cv::Size(image.cols, image.rows);
+  if(FLAGS_latency_budget > 0){
+    sam3.selectResolutionForBudget(FLAGS_latency_budget, imageSize);
+  }
   cv::Size inputSize = sam3.getInputSize();
   cv::resize(image, image, inputSize);
   end = std::chrono::steady_clock::now();
@@ -43,6 +146,50 @@ int main(int argc, char** argv) {
     std::cout<<"preprocessImage error"<<std::endl;
     return 1;
   }
+  if(FLAGS_vocabulary.size() > 0){
+    std::vector<std::string> vocabulary;
+    std::ifstream f(FLAGS_vocabulary);
+    std::string line;
+    while(std::getline(f, line)){
+      if(line.size() > 0){
+        vocabulary.push_back(line);
+      }
+    }
+    std::cout<<"Vocabulary of "<<vocabulary.size()<<" classes started"<<std::endl;
+    begin = std::chrono::steady_clock::now();
+    auto [masks, boxes] = sam3.decodeVocabulary(vocabulary, FLAGS_threshold, imageSize, FLAGS_vocabulary_chunk, FLAGS_vocabulary_iou);
+    end = std::chrono::steady_clock::now();
+    std::cout << "sec = " << (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0 <<std::endl;
+    std::vector<float> scores = sam3.getScores();
+    std::vector<int> classIds = sam3.getBatchIndices();
+    for(int i = 0; i < masks.size(); i++){
+      std::cout<<vocabulary[classIds[i]]<<" "<<scores[i]<<std::endl;
+      cv::imwrite("mask" + std::to_string(i) + ".png", masks[i]);
+    }
+    return writeTrace(&sam3);
+  }
+  if(FLAGS_bucket_prompts){
+    std::vector<std::string> text_list = split(FLAGS_text, ',');
+    auto [rects_list, labels_list] = parse_box_list_prompts(FLAGS_boxes, imageSize);
+    sam3.alignTextsAndBoxes(&text_list, &rects_list, &labels_list);
+    std::vector<Sam3Prompt> prompts(text_list.size());
+    for(int i = 0; i < prompts.size(); i++){
+      prompts[i].text = text_list[i];
+      prompts[i].rects = rects_list[i];
+      prompts[i].labels = labels_list[i];
+    }
+    begin = std::chrono::steady_clock::now();
+    std::vector<Sam3PromptResult> results = sam3.decodePrompts(prompts, FLAGS_threshold, imageSize);
+    end = std::chrono::steady_clock::now();
+    std::cout << "sec = " << (std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count()) / 1000000.0 <<std::endl;
+    for(int p = 0; p < results.size(); p++){
+      std::cout<<"prompt "<<p<<" found "<<results[p].masks.size()<<std::endl;
+      for(int i = 0; i < results[p].masks.size(); i++){
+        cv::imwrite("mask" + std::to_string(p) + "_" + std::to_string(i) + ".png", results[p].masks[i]);
+      }
+    }
+    return writeTrace(&sam3);
+  }
   std::cout<<"Encode text started"<<std::endl;
   begin = std::chrono::steady_clock::now();
   std::vector<std::string> text_list = split(FLAGS_text, ',');
@@ -57,6 +204,7 @@ int main(int argc, char** argv) {
   }
   std::cout<<"Decode started"<<std::endl;
   float threshold = FLAGS_threshold;
+  sam3.setMaskTopK(FLAGS_mask_top_k);
   bool skipDecode = false;
   auto [masks, boxes] = sam3.decode(rects_list, labels_list, threshold, imageSize, skipDecode);
   if(masks.size() == 0){
@@ -66,9 +214,18 @@ int main(int argc, char** argv) {
   std::cout<<"Found "<<masks.size()<<std::endl;
   end_total = std::chrono::steady_clock::now();
   std::cout << "predict sec = " << (std::chrono::duration_cast<std::chrono::microseconds>(end_total - begin_total).count()) / 1000000.0 <<std::endl;
+  if(FLAGS_count_allocations){
+    // The first call of each pair warms the buffers, the second one is counted
+    std::vector<std::vector<cv::Rect2f>> &rects = rects_list;
+    std::vector<std::vector<int>> &labels = labels_list;
+    printAllocations("preprocessImage", [&](){ sam3.preprocessImage(image); });
+    printAllocations("encodeText", [&](){ sam3.encodeText(text_list); });
+    printAllocations("decode", [&](){ sam3.decode(rects, labels, threshold, imageSize, false); });
+    printAllocations("changeThreshold", [&](){ sam3.decode(rects, labels, threshold, imageSize, true); });
+  }
   for(int i = 0; i < masks.size(); i++){
     std::string fileName = "mask" + std::to_string(i) + ".png";
     cv::imwrite(fileName, masks[i]);
   }
-  return 0;
+  return writeTrace(&sam3);
 }
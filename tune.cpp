@@ -0,0 +1,43 @@
+#include <gflags/gflags.h>
+#include <thread>
+#include <opencv2/opencv.hpp>
+#include "sam3.h"
+
+DEFINE_string(vision_encoder, "sam3/vision-encoder.onnx", "Path to the viion encoder model");
+DEFINE_string(text_encoder, "sam3/text-encoder.onnx", "Path to the text encoder model");
+DEFINE_string(decoder, "sam3/decoder.onnx", "Path to the decoder model");
+DEFINE_string(tokenizer, "sam3/tokenizer.json", "Path to the tokenizer");
+DEFINE_string(text, "zebra", "Text prompt");
+DEFINE_string(image, "david-tomaseti-Vw2HZQ1FGjU-unsplash.jpg", "Path to a representative image");
+DEFINE_int32(threads, 0, "Threads to tune for, 0 for all cores");
+DEFINE_int32(repeats, 3, "Timed runs per configuration");
+
+int main(int argc, char** argv) {
+  gflags::ParseCommandLineNonHelpFlags(&argc, &argv, true);
+  int threads = FLAGS_threads > 0 ? FLAGS_threads : std::thread::hardware_concurrency();
+  std::vector<std::string> available = Ort::GetAvailableProviders();
+  std::cout<<"available providers:";
+  for(int i = 0; i < available.size(); i++){
+    std::cout<<" "<<available[i];
+  }
+  std::cout<<std::endl;
+
+  Sam3 sam3;
+  if(!sam3.loadModel(FLAGS_vision_encoder, FLAGS_text_encoder, FLAGS_decoder, FLAGS_tokenizer, threads, "cpu")){
+    std::cout<<"loadModel error"<<std::endl;
+    return 1;
+  }
+  cv::Mat image = cv::imread(FLAGS_image, cv::IMREAD_COLOR);
+  if(image.empty()){
+    std::cout<<"Cannot read "<<FLAGS_image<<std::endl;
+    return 1;
+  }
+  cv::resize(image, image, sam3.getInputSize());
+  std::vector<std::string> text_list = split(FLAGS_text, ',');
+  if(!sam3.tuneSessions(image, text_list, std::max(1, FLAGS_repeats))){
+    std::cout<<"tuneSessions error"<<std::endl;
+    return 1;
+  }
+  std::cout<<"Wrote "<<getTuningPath(FLAGS_vision_encoder)<<", "<<getTuningPath(FLAGS_text_encoder)<<" and "<<getTuningPath(FLAGS_decoder)<<std::endl;
+  return 0;
+}
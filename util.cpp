@@ -70,6 +70,45 @@ bool modelExists(const std::string& modelPath){
   return true;
 }
 
+bool isValidPrecision(const std::string& precision){
+  return precision == "fp32" || precision == "fp16" || precision == "int8";
+}
+
+// fp32 models keep the plain name, other precisions are exported as name.<precision>.onnx
+std::string getModelPath(const std::string& modelDir, const std::string& name, const std::string& precision){
+  std::string path = modelDir + "/" + name;
+  if(precision != "fp32"){
+    path += "." + precision;
+  }
+  return path + ".onnx";
+}
+
+// export_v2.py writes the precision into the model metadata
+std::string getModelPrecision(Ort::Session *session){
+  Ort::AllocatorWithDefaultOptions alloc;
+  auto precision = session->GetModelMetadata().LookupCustomMetadataMapAllocated("precision", alloc);
+  if(!precision){
+    return "unknown";
+  }
+  return precision.get();
+}
+
+// decoder-score[.precision].onnx -> decoder-mask[.precision].onnx
+std::string getMaskDecoderPath(const std::string& decoderPath){
+  std::string score = "decoder-score";
+  size_t pos = decoderPath.rfind(score);
+  if(pos == std::string::npos){
+    return "";
+  }
+  std::string path = decoderPath;
+  return path.replace(pos, score.size(), "decoder-mask");
+}
+
+// Session settings chosen by tuneSessions are stored next to the model.
+std::string getTuningPath(const std::string& modelPath){
+  return modelPath + ".tuning";
+}
+
 std::string LoadBytesFromFile(const std::string& path) {
   std::string data;
   std::ifstream fs(path, std::ios::in | std::ios::binary);
@@ -108,6 +147,15 @@ std::vector<int> sort_indexes(const std::vector<float> &v) {
   return idx;
 }
 
+// Same order as the stable sort above without its temporary buffer: ties keep index order.
+void sort_indexes(const std::vector<float> &v, std::vector<int> *idx) {
+  idx->resize(v.size());
+  std::iota(idx->begin(), idx->end(), 0);
+  std::sort(idx->begin(), idx->end(), [&v](int i1, int i2) {
+    return v[i1] > v[i2] || (v[i1] == v[i2] && i1 < i2);
+  });
+}
+
 float calc_iou(const std::vector<int> &box1, const std::vector<int> &box2) {
   int inter_x1 = std::max(box1[0], box2[0]);
   int inter_y1 = std::max(box1[1], box2[1]);
@@ -125,6 +173,17 @@ float calc_iou(const std::vector<int> &box1, const std::vector<int> &box2) {
   return (float)inter_area / union_area;
 }
 
+float calc_mask_iou(const cv::Mat &mask1, const cv::Mat &mask2){
+  cv::Mat intersection, unionMask;
+  cv::bitwise_and(mask1, mask2, intersection);
+  cv::bitwise_or(mask1, mask2, unionMask);
+  int unionArea = cv::countNonZero(unionMask);
+  if(unionArea == 0){
+    return 1;
+  }
+  return (float)cv::countNonZero(intersection) / unionArea;
+}
+
 bool can_append_box(const std::vector<int> box, const std::vector<int> &boxes){
   float threshold = 0.9;
   int num = (int)boxes.size() / 4;
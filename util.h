@@ -15,11 +15,18 @@ std::tuple<std::vector<std::vector<cv::Rect2f>>, std::vector<std::vector<int>>>
 std::tuple<std::vector<cv::Rect2f>, std::vector<int>> parse_box_prompts(const std::string &boxes);
 void normalizeRects(std::vector<cv::Rect2f> *rects, const cv::Size &imageSize);
 bool modelExists(const std::string& modelPath);
+bool isValidPrecision(const std::string& precision);
+std::string getModelPath(const std::string& modelDir, const std::string& name, const std::string& precision);
+std::string getModelPrecision(Ort::Session *session);
+std::string getMaskDecoderPath(const std::string& decoderPath);
+std::string getTuningPath(const std::string& modelPath);
 std::string LoadBytesFromFile(const std::string& path);
 void printShape(const std::vector<int64_t> &shape);
 int getShapeSize(const std::vector<int64_t> &shape);
 std::vector<int> sort_indexes(const std::vector<float> &v);
+void sort_indexes(const std::vector<float> &v, std::vector<int> *idx);
 float calc_iou(const std::vector<int> &box1, const std::vector<int> &box2);
+float calc_mask_iou(const cv::Mat &mask1, const cv::Mat &mask2);
 bool can_append_box(const std::vector<int> box, const std::vector<int> &boxes);
 
 #endif